@@ -42,11 +42,58 @@ extern "C" {
  */
 
 #define AC_MAX_ALPHABET_SIZE 256
-#define AC_DEFAULT_NODE_CAPACITY 1024
+#define AC_DEFAULT_NODE_CAPACITY 16     // Initial node pool size; the pool grows on demand
+#define AC_ROOT 0                       // Index of the root node in the node pool
+
+/**
+ * Boundary classes a pattern can require next to its matches
+ *
+ * A side with a class only matches at the start or end of the text or next
+ * to a delimiter byte of that class:
+ *  - AC_BOUNDARY_WORD: any byte but ASCII letters, digits, '_' and bytes of
+ *    multi-byte UTF-8 characters ("v1.0" does not match in "v1.01" or "xv1.0")
+ *  - AC_BOUNDARY_PATH: '/', '?', '#', '&', '=', whitespace, quotes, '<', '>',
+ *    '(' and ')' (whole URL path segments)
+ *  - AC_BOUNDARY_ATTRIBUTE: whitespace, quotes, '=', '<' and '>' (whole
+ *    attribute values and tag names)
+ */
+typedef enum {
+    AC_BOUNDARY_NONE = 0,
+    AC_BOUNDARY_WORD,
+    AC_BOUNDARY_PATH,
+    AC_BOUNDARY_ATTRIBUTE
+} ac_boundary_t;
+
+#define AC_BOUNDARY_MAX AC_BOUNDARY_ATTRIBUTE
+
+/**
+ * HTML contexts a pattern can be restricted to (bit mask)
+ *
+ * Searches with context-restricted patterns run a small HTML tokenizer in
+ * the same pass as the matcher. Each byte of the text is in one context:
+ *  - AC_CONTEXT_TEXT: text between tags
+ *  - AC_CONTEXT_TAG: markup: '<', tag and attribute names, '=', the quotes
+ *    around attribute values, '>', end tags, doctypes
+ *  - AC_CONTEXT_ATTRIBUTE: attribute values
+ *  - AC_CONTEXT_SCRIPT: contents of <script> and <style> elements
+ *  - AC_CONTEXT_COMMENT: comments, from "<!--" to "-->"
+ * A restricted pattern only matches when the whole match lies in one run of
+ * a single context, and that context is one of its own: a match crossing
+ * from one allowed context into another is dropped. The tokenizer is lenient
+ * and never fails: it is meant to tell the parts of a page apart, not to
+ * validate it.
+ */
+#define AC_CONTEXT_TEXT      0x01
+#define AC_CONTEXT_TAG       0x02
+#define AC_CONTEXT_ATTRIBUTE 0x04
+#define AC_CONTEXT_SCRIPT    0x08
+#define AC_CONTEXT_COMMENT   0x10
+#define AC_CONTEXT_ALL       0x1f
 
 typedef struct ac_node ac_node_t;
 typedef struct ac_automaton ac_automaton_t;
 typedef struct ac_match ac_match_t;
+typedef struct ac_memory_stats ac_memory_stats_t;
 
 /**
  * Match structure representing a found pattern
@@ -58,15 +105,20 @@ struct ac_match {
     const char *replacement; // Replacement string
     size_t pattern_len;     // Length of the pattern
     size_t replacement_len; // Length of the replacement
+    size_t pattern_id;      // Index of the pattern in the compiled image (see ac_get_pattern)
 };
 
 /**
  * Node in the Aho-Corasick trie
+ *
+ * Links are indices into the automaton's node pool rather than pointers, so
+ * the pool can be grown and trimmed with realloc. The root is never a child
+ * nor an output, so AC_ROOT doubles as "no link" for children and output.
  */
 struct ac_node {
-    ac_node_t *children[AC_MAX_ALPHABET_SIZE];  // Children nodes
-    ac_node_t *failure;                         // Failure link
-    ac_node_t *output;                          // Output link for matches
+    uint32_t children[AC_MAX_ALPHABET_SIZE];    // Children node indices (AC_ROOT if none)
+    uint32_t failure;                           // Failure link
+    uint32_t output;                            // Output link for matches (AC_ROOT if none)
 
     const char *pattern;                        // Pattern ending at this node (NULL if none)
     const char *replacement;                    // Replacement for the pattern
@@ -74,19 +126,46 @@ struct ac_node {
     size_t replacement_len;                     // Length of replacement
 
     void *user_data;                           // User data associated with pattern (for callbacks)
+    uint8_t left_boundary;                     // ac_boundary_t required before matches
+    uint8_t right_boundary;                    // ac_boundary_t required after matches
+    uint8_t contexts;                          // AC_CONTEXT_* mask matches must lie in (0 for any)
 
     bool is_end;                               // True if this node represents end of a pattern
     uint32_t node_id;                          // Unique node identifier
+
+    uint32_t parent;                           // Parent node (AC_ROOT for the root's children)
+    uint32_t child_count;                      // Number of children
+    unsigned char label;                       // Byte leading here from the parent
+
+    // Inverse failure tree: the nodes whose failure link points here, so a
+    // compiled automaton can be updated without rebuilding every link.
+    // Removed nodes are chained through fail_next on the free list.
+    uint32_t fail_child;                       // First node failing to this one (AC_ROOT if none)
+    uint32_t fail_next;                        // Next node sharing this node's failure target
+    uint32_t fail_prev;                        // Previous node sharing this node's failure target
 };
 
 /**
  * Aho-Corasick automaton structure
  */
 struct ac_automaton {
-    ac_node_t *root;                           // Root node of the trie
-    ac_node_t *nodes;                          // Pool of nodes
+    ac_node_t *nodes;                          // Pool of nodes, root at AC_ROOT
     size_t node_count;                         // Number of nodes used
-    size_t node_capacity;                      // Total capacity of node pool
+    size_t node_capacity;                      // Total capacity of node pool (trimmed by ac_compile)
+    bool keep_trie;                            // ac_compile keeps the trie (see ac_set_keep_trie)
+    
+    const void *image;                         // Compiled search image (see ac_relocate_image)
+    bool owns_image;                           // True if image was allocated by ac_compile or mapped by ac_load
+    size_t mapped_size;                        // Length of the file mapping behind image (0 if not mapped)
+    void **user_data;                          // Per-pattern user data, indexed by pattern_id
+    uint32_t *pattern_nodes;                   // Trie node of each image pattern (NULL without a trie)
+    size_t pattern_count;                      // Number of patterns in the image
+
+    uint32_t free_list;                        // Removed node slots for reuse (AC_ROOT if none)
+    size_t free_count;                         // Number of slots on the free list
+    size_t trie_pattern_count;                 // Number of patterns in the trie
+    bool case_insensitive;                     // ASCII letters match either case (ac_set_case_insensitive)
+    bool html_contexts;                        // Some pattern was restricted with ac_set_contexts
     
     bool is_compiled;                          // True if automaton is compiled (failure links built)
 };
@@ -103,6 +182,9 @@ typedef bool (*ac_match_callback_t)(const ac_match_t *match, void *user_data);
 /**
  * Initialize a new Aho-Corasick automaton
  * 
+ * The node pool starts at the given capacity, doubles as patterns are added
+ * and is trimmed to the actual trie size by ac_compile.
+ * 
  * @param capacity Initial capacity for nodes (0 for default)
  * @return Pointer to initialized automaton, or NULL on failure
  */
@@ -115,6 +197,21 @@ ac_automaton_t *ac_create(size_t capacity);
  */
 void ac_destroy(ac_automaton_t *ac);
 
+/**
+ * Match ASCII letters regardless of case
+ *
+ * Patterns are stored in lower case and the compiled image maps upper-case
+ * letters to the same byte classes, so searching is as fast as with exact
+ * matching and the text is never copied. Patterns differing only in case
+ * are then one pattern, the last one added. Reported matches carry the
+ * pattern as it was added. The setting is kept by ac_save and ac_reset.
+ *
+ * @param ac Pointer to automaton without patterns
+ * @param enabled true to ignore case, false for exact matching (the default)
+ * @return true on success, false if the automaton already has patterns
+ */
+bool ac_set_case_insensitive(ac_automaton_t *ac, bool enabled);
+
 /**
  * Add a pattern and its replacement to the automaton
  * 
@@ -129,15 +226,108 @@ bool ac_add_pattern(ac_automaton_t *ac,
                     const char *pattern, size_t pattern_len,
                     const char *replacement, size_t replacement_len);
 
+/**
+ * Require boundaries around the matches of a pattern
+ *
+ * Matches without the required neighbours are dropped inside the scan, so
+ * they never reach search callbacks or replacements. Boundaries are kept in
+ * the compiled image and its saved files; after a change, searches walk the
+ * trie until ac_compile is called again. Adding the pattern again clears them.
+ *
+ * @param ac Pointer to automaton with a trie (not yet compiled, or see ac_set_keep_trie)
+ * @param pattern Pattern added before
+ * @param pattern_len Length of pattern (0 for strlen)
+ * @param left Class required before matches (AC_BOUNDARY_NONE for any byte)
+ * @param right Class required after matches (AC_BOUNDARY_NONE for any byte)
+ * @return true on success, false if the pattern is not present or a class is unknown
+ */
+bool ac_set_boundaries(ac_automaton_t *ac, const char *pattern, size_t pattern_len,
+                       ac_boundary_t left, ac_boundary_t right);
+
+/**
+ * Restrict a pattern to HTML contexts
+ *
+ * Matches outside the contexts, or spanning several of them (even when all
+ * are in the mask), are dropped inside the scan like matches failing their
+ * boundaries (see ac_set_boundaries). An
+ * automaton without restricted patterns never runs the tokenizer.
+ *
+ * @param ac Pointer to automaton with a trie (not yet compiled, or see ac_set_keep_trie)
+ * @param pattern Pattern added before
+ * @param pattern_len Length of pattern (0 for strlen)
+ * @param contexts AC_CONTEXT_* mask, 0 to match in any context
+ * @return true on success, false if the pattern is not present or the mask is invalid
+ */
+bool ac_set_contexts(ac_automaton_t *ac, const char *pattern, size_t pattern_len,
+                     unsigned contexts);
+
+/**
+ * Check the boundaries of a match found some other way
+ *
+ * Applies the rules of ac_set_boundaries to the span text[start_pos..end_pos],
+ * e.g. for a replacement callback that reuses a pattern for several rules.
+ *
+ * @param text Text the span is in
+ * @param text_len Length of text
+ * @param start_pos First byte of the span
+ * @param end_pos Last byte of the span
+ * @param left Class required before the span
+ * @param right Class required after the span
+ * @return true if both boundaries hold
+ */
+bool ac_boundaries_hold(const char *text, size_t text_len, size_t start_pos, size_t end_pos,
+                        ac_boundary_t left, ac_boundary_t right);
+
 /**
  * Compile the automaton by building failure links
- * Must be called after adding all patterns and before searching
+ * Must be called after adding all patterns and before searching.
+ * The trie is then freed, leaving only the search image, unless
+ * ac_set_keep_trie asked to keep it; a kept node pool is trimmed to size.
+ *
+ * With the trie kept, patterns may still be added or removed afterwards: the
+ * failure and output links are repaired in place, touching only the states
+ * the change can affect, and the automaton stays searchable. Until
+ * ac_compile is called again, searches walk the linked trie instead of the
+ * faster flat image, and the image-only calls (ac_get_pattern, ac_save, ...)
+ * are unavailable. Calling ac_compile on an up-to-date automaton is a no-op.
+ *
+ * Compiling again after such changes reuses the repaired links but still
+ * flattens the whole trie into a new image, at the cost of a first compile
+ * minus the link construction. Batch changes rather than compiling after
+ * each one.
  * 
  * @param ac Pointer to automaton
  * @return true on success, false on failure
  */
 bool ac_compile(ac_automaton_t *ac);
 
+/**
+ * Keep the trie after ac_compile
+ *
+ * Needed to add or remove patterns, or set boundaries and contexts, once
+ * the automaton is compiled. The trie takes several times the memory of
+ * the image, so it is freed by default. The setting is kept by ac_reset.
+ *
+ * @param ac Pointer to automaton
+ * @param keep true to keep the trie, false to free it on the next ac_compile
+ * @return true on success, false if keep is asked for and the trie is already gone
+ */
+bool ac_set_keep_trie(ac_automaton_t *ac, bool keep);
+
+/**
+ * Remove a pattern
+ *
+ * Works before and after ac_compile; on a compiled automaton only the states
+ * below the pattern's node in the failure tree are visited, and trie nodes
+ * left without a pattern are recycled for later additions.
+ *
+ * @param ac Pointer to automaton with a trie (not yet compiled, or see ac_set_keep_trie)
+ * @param pattern Pattern to remove
+ * @param pattern_len Length of pattern (0 to use strlen)
+ * @return true if the pattern was removed, false if it was not present
+ */
+bool ac_remove_pattern(ac_automaton_t *ac, const char *pattern, size_t pattern_len);
+
 /**
  * Search for patterns in text and call callback for each match
  * 
@@ -197,7 +387,9 @@ char *ac_replace_alloc(const ac_automaton_t *ac,
  * @param user_data User data from the pattern (set via ac_add_pattern_ex)
  * @param context_data User context data passed to ac_replace_with_callback
  * @param replacement_len Output: length of the returned replacement string
- * @return Replacement string (must remain valid until next callback call)
+ * @return Replacement string (must remain valid until the result is built), or
+ *         NULL to decline the match: the text is kept and overlapping matches
+ *         may apply instead, as if the pattern had not matched
  */
 typedef const char* (*ac_replacement_callback_t)(
     const char *pattern,
@@ -231,7 +423,11 @@ bool ac_add_pattern_ex(ac_automaton_t *ac,
  *
  * This function uses a precompiled automaton but allows dynamic replacement
  * generation via a callback. This is ideal for variable expansion without
- * recompiling the automaton.
+ * recompiling the automaton. The callback runs only for matches that are
+ * applied, leftmost first, and may decline a match (e.g. to serve several
+ * rule sets from one automaton). Patterns added with a static replacement
+ * and no user data skip the callback and are replaced with that string, so
+ * static and dynamic rules can share one automaton and one scan.
  *
  * @param ac Compiled automaton
  * @param text Text to process
@@ -247,17 +443,207 @@ char *ac_replace_with_callback(const ac_automaton_t *ac,
                                void *context_data,
                                size_t *result_len);
 
+/**
+ * Callback function type for replacements that may cover more than the pattern
+ *
+ * Like ac_replacement_callback_t, but the callback sees the whole text and
+ * may move match->start_pos and match->end_pos to replace a different span,
+ * e.g. a regular expression match found around a literal the pattern stands
+ * for. The span must be non-empty, lie within the text and start at or after
+ * min_start, the end of the last applied replacement; otherwise the match is
+ * declined.
+ *
+ * @param text The text being processed
+ * @param text_len Length of the text
+ * @param min_start First position the replaced span may start at
+ * @param match The match, whose start_pos and end_pos may be changed
+ * @param user_data User data from the pattern (set via ac_add_pattern_ex)
+ * @param context_data User context data passed to ac_replace_with_span_callback
+ * @param replacement_len Output: length of the returned replacement string
+ * @return Replacement string (valid until the result is built), or NULL to decline
+ */
+typedef const char* (*ac_span_callback_t)(
+    const char *text,
+    size_t text_len,
+    size_t min_start,
+    ac_match_t *match,
+    void *user_data,
+    void *context_data,
+    size_t *replacement_len
+);
+
+/**
+ * Perform string replacement with a span-adjusting callback
+ *
+ * Same as ac_replace_with_callback, including the static pattern shortcut,
+ * except that the callback chooses the replaced span (see ac_span_callback_t).
+ * Matches are offered leftmost first by pattern position; a span extending
+ * past later matches makes them overlap and skips them.
+ *
+ * @param ac Compiled automaton
+ * @param text Text to process
+ * @param text_len Length of input text
+ * @param callback Callback to choose spans and generate replacement strings
+ * @param context_data User context passed to callback
+ * @param result_len Pointer to store length of result
+ * @return Newly allocated buffer with replacements, or NULL on error
+ */
+char *ac_replace_with_span_callback(const ac_automaton_t *ac,
+                                    const char *text, size_t text_len,
+                                    ac_span_callback_t callback,
+                                    void *context_data,
+                                    size_t *result_len);
+
+/**
+ * Perform string replacement on a prefix of the text
+ *
+ * Same as ac_replace_with_span_callback, except that only matches and spans
+ * ending within the first scan_len bytes are replaced. The bytes after them
+ * are copied unchanged, but boundaries and contexts still see them, so a
+ * match ending at the edge of the prefix is not taken to end the text.
+ *
+ * @param ac Compiled automaton
+ * @param text Text to process
+ * @param text_len Length of input text
+ * @param scan_len Length of the prefix to replace in, at most text_len
+ * @param callback Callback to choose spans and generate replacement strings
+ * @param context_data User context passed to callback
+ * @param result_len Pointer to store length of result
+ * @return Newly allocated buffer with replacements, or NULL on error
+ */
+char *ac_replace_prefix_with_span_callback(const ac_automaton_t *ac,
+                                           const char *text, size_t text_len, size_t scan_len,
+                                           ac_span_callback_t callback,
+                                           void *context_data,
+                                           size_t *result_len);
+
+/**
+ * Size of the compiled search image
+ *
+ * ac_compile flattens the trie into a single self-contained block holding
+ * the transition table, the pattern table and the pattern strings, addressed
+ * only by offsets. All searches run on this image.
+ *
+ * @param ac Automaton
+ * @return Image size in bytes, or 0 if the automaton has no current image
+ */
+size_t ac_image_size(const ac_automaton_t *ac);
+
+/**
+ * Move the compiled search image into caller-provided memory
+ *
+ * Copies the image to dest and searches from there from now on, e.g. so that
+ * processes forked after compile share one read-only copy. The trie is freed,
+ * so no further patterns can be added until ac_reset. The caller keeps dest
+ * alive and unchanged for the automaton's lifetime.
+ *
+ * @param ac Compiled automaton
+ * @param dest Destination, aligned to 8 bytes
+ * @param dest_size Size of dest, at least ac_image_size(ac)
+ * @return true on success, false on error (image left in place)
+ */
+bool ac_relocate_image(ac_automaton_t *ac, void *dest, size_t dest_size);
+
+/**
+ * Save the compiled search image to a file
+ *
+ * The file holds the image exactly as searched, tagged with the image version
+ * and the host byte order and protected by a checksum. User data is not
+ * saved; after ac_load, attach it with ac_set_user_data.
+ *
+ * The image is written to a temporary file in the same directory, synced and
+ * renamed over path, so an existing file is replaced atomically: processes
+ * that loaded it keep searching the old image, and a crash while writing
+ * leaves the old file in place.
+ *
+ * @param ac Compiled automaton
+ * @param path File to write (replaced if it exists)
+ * @return true on success, false on error (no partial file is left behind)
+ */
+bool ac_save(const ac_automaton_t *ac, const char *path);
+
+/**
+ * Load a search image written by ac_save
+ *
+ * The file is mapped read-only and searched in place: loading costs one
+ * validation and checksum pass over the mapping, independent of how long
+ * the rule set took to compile. Processes loading the same file share its
+ * pages through the page cache. The result is a compiled automaton without
+ * a trie, so patterns cannot be added until ac_reset.
+ *
+ * @param path File written by ac_save
+ * @return Compiled automaton, or NULL if the file is missing, damaged, or
+ *         written with another image version or byte order
+ */
+ac_automaton_t *ac_load(const char *path);
+
+/**
+ * Get a pattern of a compiled automaton by id
+ *
+ * Pattern ids run from 0 to the pattern count reported by ac_get_stats and
+ * are the ids reported in ac_match.pattern_id. They are assigned by
+ * ac_compile; after adding or removing patterns, compile again first.
+ *
+ * @param ac Compiled automaton
+ * @param pattern_id Pattern id
+ * @param pattern Output: NUL-terminated pattern (can be NULL)
+ * @param pattern_len Output: length of the pattern (can be NULL)
+ * @param replacement Output: NUL-terminated static replacement, NULL if the
+ *        pattern was added without one (can be NULL)
+ * @param replacement_len Output: length of the replacement (can be NULL)
+ * @return true on success, false if the id is out of range
+ */
+bool ac_get_pattern(const ac_automaton_t *ac, size_t pattern_id,
+                    const char **pattern, size_t *pattern_len,
+                    const char **replacement, size_t *replacement_len);
+
+/**
+ * Set the user data passed to the replacement callback for a pattern
+ *
+ * @param ac Compiled automaton
+ * @param pattern_id Pattern id
+ * @param user_data User data for the pattern
+ * @return true on success, false if the id is out of range
+ */
+bool ac_set_user_data(ac_automaton_t *ac, size_t pattern_id, void *user_data);
+
 /**
  * Get statistics about the automaton
  * 
  * @param ac Automaton
  * @param node_count Pointer to store number of nodes (can be NULL)
  * @param pattern_count Pointer to store number of patterns (can be NULL)
- * @param memory_usage Pointer to store estimated memory usage (can be NULL)
+ * @param memory_usage Pointer to store memory in use: trie nodes, image and
+ *        per-pattern tables (can be NULL)
  */
 void ac_get_stats(const ac_automaton_t *ac,
                   size_t *node_count, size_t *pattern_count, size_t *memory_usage);
 
+/**
+ * Memory held by an automaton, by structure
+ */
+struct ac_memory_stats {
+    size_t state_count;         // States of the image (trie nodes while there is none)
+    size_t class_count;         // Byte classes of the image (0 without one)
+    size_t pattern_count;       // Number of patterns
+    size_t transition_bytes;    // Image transition table, one row per state
+    size_t output_bytes;        // Image pattern table: output chains and string offsets
+    size_t string_bytes;        // Image pattern and replacement strings
+    size_t image_bytes;         // Whole image, including header and padding
+    size_t trie_bytes;          // Trie nodes in use, kept for later changes (0 after ac_load)
+    size_t table_bytes;         // Per-pattern user data and node index tables
+};
+
+/**
+ * Get a breakdown of the memory held by an automaton
+ *
+ * Unlike ac_get_stats, counts the trie by nodes in use, not pool capacity.
+ *
+ * @param ac Automaton
+ * @param stats Output
+ */
+void ac_get_memory_stats(const ac_automaton_t *ac, ac_memory_stats_t *stats);
+
 /**
  * Reset automaton to empty state (removes all patterns)
  * 
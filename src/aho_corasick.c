@@ -30,29 +30,271 @@
 
 #define AHO_CORASICK_VERSION "1.1.0"
 
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L  // mmap, fstat
+#endif
+
 #include "../inc/aho_corasick.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Compiled search image
+ *
+ * ac_compile flattens the trie into one pointer-free block: a DFA over byte
+ * classes with failure transitions already resolved, the pattern table and a
+ * string arena, all addressed by offsets from the start of the block. The
+ * image is never written after compile, so it can be copied anywhere (shared
+ * memory, a file) and searched in place.
+ *
+ * Each state is a row of class_count + 1 uint32 cells: cell 0 holds the first
+ * pattern reported in that state (id + 1, 0 for none) and cell c the row
+ * offset of the next state on byte class c. Storing row offsets rather than
+ * state numbers keeps multiplications out of the scan loop. States are laid
+ * out in BFS order so the shallow, hot states share cache lines.
+ *
+ * A case-insensitive automaton spells its trie in lower case and maps each
+ * upper-case ASCII letter to the class of its lower-case form, so folding
+ * costs nothing in the scan loop.
+ *
+ * Pattern boundaries (ac_set_boundaries) and HTML contexts (ac_set_contexts)
+ * live in the pattern flags; patterns without them cost one flag test per
+ * reported match. Images with context-restricted patterns are flagged in
+ * the header and scanned by a separate loop that also runs the tokenizer.
+ *
+ * ac_save writes the image as is, so a saved file is mmapped by ac_load and
+ * searched without any rebuild. Files are only loaded on hosts with the
+ * byte order and image version they were written with.
+ */
+#define AC_IMAGE_MAGIC      0x31494341u  // "ACI1" in memory order on little-endian hosts
+#define AC_IMAGE_VERSION    2  // 2: pattern boundaries and contexts
+#define AC_IMAGE_BYTE_ORDER 0x01020304u
+#define AC_IMAGE_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byte_order;                       // AC_IMAGE_BYTE_ORDER as stored by the building host
+    uint32_t flags;                            // AC_IMAGE_CASE_INSENSITIVE, AC_IMAGE_HTML_CONTEXTS
+    uint64_t size;                             // Total image size in bytes
+    uint64_t checksum;                         // Set by ac_save, see ac_image_checksum
+    uint32_t state_count;
+    uint32_t class_count;                      // Byte classes, numbered from 1
+    uint32_t pattern_count;
+    uint32_t string_size;
+    uint64_t table_offset;                     // uint32_t[state_count * (class_count + 1)]
+    uint64_t pattern_offset;                   // ac_image_pattern_t[pattern_count]
+    uint64_t string_offset;                    // NUL-terminated patterns and replacements
+    uint16_t byte_class[AC_MAX_ALPHABET_SIZE]; // Byte -> class
+} ac_image_header_t;
+
+typedef struct {
+    uint32_t pattern_offset;                   // Offsets into the string arena
+    uint32_t replacement_offset;
+    uint32_t pattern_len;
+    uint32_t replacement_len;
+    uint32_t next_output;                      // Next pattern reported in the same state (id + 1, 0 for none)
+    uint32_t flags;
+} ac_image_pattern_t;
+
+#define AC_IMAGE_HAS_REPLACEMENT 0x1           // Pattern was added with a static replacement
+#define AC_IMAGE_LEFT_SHIFT      8             // Bits 8-15: ac_boundary_t before matches
+#define AC_IMAGE_RIGHT_SHIFT     16            // Bits 16-23: ac_boundary_t after matches
+#define AC_IMAGE_BOUNDED         0xffff00u     // Pattern has a boundary on either side
+#define AC_IMAGE_CONTEXT_SHIFT   24            // Bits 24-31: AC_CONTEXT_* mask
+
+#define AC_IMAGE_CASE_INSENSITIVE 0x1          // Header flag: ASCII letters match either case
+#define AC_IMAGE_HTML_CONTEXTS    0x2          // Header flag: some pattern has contexts
+
+/* Byte as spelled in the trie: ASCII letters in lower case when folding */
+static inline unsigned char ac_fold(const ac_automaton_t *ac, unsigned char c) {
+    return (ac->case_insensitive && c >= 'A' && c <= 'Z') ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+/* Is c a delimiter of boundary class boundary (see ac_boundary_t)? */
+static inline bool ac_is_delimiter(unsigned boundary, unsigned char c) {
+    switch (boundary) {
+    case AC_BOUNDARY_WORD:
+        return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                 (c >= '0' && c <= '9') || c == '_' || c >= 0x80);
+    case AC_BOUNDARY_PATH:
+        return c == '/' || c == '?' || c == '#' || c == '&' || c == '=' || c == '(' || c == ')' ||
+               c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+               c == '"' || c == '\'' || c == '<' || c == '>';
+    case AC_BOUNDARY_ATTRIBUTE:
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+               c == '"' || c == '\'' || c == '=' || c == '<' || c == '>';
+    default:
+        return true;
+    }
+}
+
+static inline bool ac_check_boundaries(const char *text, size_t text_len,
+                                       size_t start_pos, size_t end_pos,
+                                       unsigned left, unsigned right) {
+    return (start_pos == 0 || ac_is_delimiter(left, (unsigned char)text[start_pos - 1])) &&
+           (end_pos + 1 >= text_len || ac_is_delimiter(right, (unsigned char)text[end_pos + 1]));
+}
 
 /**
- * Queue structure for BFS during failure link construction
+ * HTML tokenizer run alongside the matcher for context-restricted patterns
+ *
+ * One step per byte, returning the byte's AC_CONTEXT_*. The whole text is
+ * available, so a '<' looks ahead to tell a tag, end tag, comment or
+ * declaration from a literal '<' in text, and to spot the "</script" or
+ * "</style" that ends raw text, instead of tracking partial names.
  */
+typedef enum {
+    AC_HTML_TEXT,
+    AC_HTML_TAG,            // Tag name and attributes
+    AC_HTML_AFTER_EQ,       // Between '=' and an attribute value
+    AC_HTML_VALUE_DQ,       // "value"
+    AC_HTML_VALUE_SQ,       // 'value'
+    AC_HTML_VALUE,          // Unquoted value
+    AC_HTML_DECL,           // End tag, doctype or processing instruction, up to '>'
+    AC_HTML_COMMENT,
+    AC_HTML_RAW             // Contents of <script> or <style>
+} ac_html_state_t;
+
 typedef struct {
-    ac_node_t **nodes;
-    size_t front;
-    size_t rear;
+    ac_html_state_t state;
+    uint8_t raw;            // Raw text element of the open tag: 0, or length of "script"/"style"
+    size_t comment_start;   // First byte after "<!--"
+} ac_html_t;
+
+static inline bool ac_html_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static inline unsigned char ac_lower(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+/* Length of "script" or "style" if the tag name at text is one, else 0 */
+static uint8_t ac_html_raw_element(const char *text, size_t len) {
+    static const char *const names[] = { "script", "style" };
+
+    for (int n = 0; n < 2; n++) {
+        size_t name_len = strlen(names[n]);
+        size_t i = 0;
+        while (i < name_len && i < len && ac_lower((unsigned char)text[i]) == names[n][i]) i++;
+        if (i == name_len && (i == len || ac_html_space((unsigned char)text[i]) ||
+                              text[i] == '>' || text[i] == '/')) {
+            return (uint8_t)name_len;
+        }
+    }
+    return 0;
+}
+
+static inline unsigned ac_html_step(ac_html_t *html, const char *text, size_t text_len, size_t i) {
+    unsigned char c = (unsigned char)text[i];
+    unsigned char next = i + 1 < text_len ? (unsigned char)text[i + 1] : '\0';
+
+    switch (html->state) {
+    case AC_HTML_TEXT:
+        if (c != '<') return AC_CONTEXT_TEXT;
+        if ((next >= 'a' && next <= 'z') || (next >= 'A' && next <= 'Z')) {
+            html->state = AC_HTML_TAG;
+            html->raw = ac_html_raw_element(text + i + 1, text_len - i - 1);
+            return AC_CONTEXT_TAG;
+        }
+        if (next == '!' && i + 3 < text_len && text[i + 2] == '-' && text[i + 3] == '-') {
+            html->state = AC_HTML_COMMENT;
+            html->comment_start = i + 4;
+            return AC_CONTEXT_COMMENT;
+        }
+        if (next == '/' || next == '!' || next == '?') {
+            html->state = AC_HTML_DECL;
+            return AC_CONTEXT_TAG;
+        }
+        return AC_CONTEXT_TEXT;
+    case AC_HTML_TAG:
+        if (c == '>') {
+            html->state = html->raw ? AC_HTML_RAW : AC_HTML_TEXT;
+        } else if (c == '=') {
+            html->state = AC_HTML_AFTER_EQ;
+        }
+        return AC_CONTEXT_TAG;
+    case AC_HTML_AFTER_EQ:
+        if (c == '"') {
+            html->state = AC_HTML_VALUE_DQ;
+        } else if (c == '\'') {
+            html->state = AC_HTML_VALUE_SQ;
+        } else if (c == '>') {
+            html->state = html->raw ? AC_HTML_RAW : AC_HTML_TEXT;
+        } else if (!ac_html_space(c)) {
+            html->state = AC_HTML_VALUE;
+            return AC_CONTEXT_ATTRIBUTE;
+        }
+        return AC_CONTEXT_TAG;
+    case AC_HTML_VALUE_DQ:
+    case AC_HTML_VALUE_SQ:
+        if (c == (html->state == AC_HTML_VALUE_DQ ? '"' : '\'')) {
+            html->state = AC_HTML_TAG;
+            return AC_CONTEXT_TAG;
+        }
+        return AC_CONTEXT_ATTRIBUTE;
+    case AC_HTML_VALUE:
+        if (c == '>') {
+            html->state = html->raw ? AC_HTML_RAW : AC_HTML_TEXT;
+            return AC_CONTEXT_TAG;
+        }
+        if (ac_html_space(c)) {
+            html->state = AC_HTML_TAG;
+            return AC_CONTEXT_TAG;
+        }
+        return AC_CONTEXT_ATTRIBUTE;
+    case AC_HTML_DECL:
+        if (c == '>') html->state = AC_HTML_TEXT;
+        return AC_CONTEXT_TAG;
+    case AC_HTML_COMMENT:
+        if (c == '>' && i >= html->comment_start + 2 && text[i - 1] == '-' && text[i - 2] == '-') {
+            html->state = AC_HTML_TEXT;
+        }
+        return AC_CONTEXT_COMMENT;
+    case AC_HTML_RAW:
+        if (c == '<' && next == '/' &&
+            ac_html_raw_element(text + i + 2, text_len - i - 2) == html->raw) {
+            html->state = AC_HTML_DECL;
+            html->raw = 0;
+            return AC_CONTEXT_TAG;
+        }
+        return AC_CONTEXT_SCRIPT;
+    }
+    return AC_CONTEXT_TEXT;
+}
+
+#define AC_IMAGE_AT(image, offset, type) ((type)((const char *)(image) + (offset)))
+
+/**
+ * Growable stack of node indices for walks over the inverse failure tree
+ */
+typedef struct {
+    uint32_t *items;
+    size_t count;
     size_t capacity;
-} ac_queue_t;
+} ac_stack_t;
 
 /* Forward declarations */
-static ac_node_t *ac_node_create(ac_automaton_t *ac);
-static void ac_build_failure_links(ac_automaton_t *ac);
-static ac_queue_t *ac_queue_create(size_t capacity);
-static void ac_queue_destroy(ac_queue_t *queue);
-static bool ac_queue_push(ac_queue_t *queue, ac_node_t *node);
-static ac_node_t *ac_queue_pop(ac_queue_t *queue);
-static bool ac_queue_empty(const ac_queue_t *queue);
+static bool ac_node_create(ac_automaton_t *ac, uint32_t *index);
+static void ac_node_free(ac_automaton_t *ac, uint32_t index);
+static uint32_t ac_insert_path(ac_automaton_t *ac, const char *pattern, size_t pattern_len);
+static uint32_t *ac_build_failure_links(ac_automaton_t *ac, size_t *state_count);
+static uint32_t *ac_bfs_order(const ac_automaton_t *ac, size_t *state_count);
+static bool ac_build_image(ac_automaton_t *ac, const uint32_t *order, size_t state_count);
+static void ac_release_image(ac_automaton_t *ac);
+static void ac_release_trie(ac_automaton_t *ac);
+static void ac_fail_attach(ac_node_t *nodes, uint32_t node, uint32_t failure);
+static void ac_fail_detach(ac_node_t *nodes, uint32_t node);
+static bool ac_link_new_node(ac_automaton_t *ac, uint32_t node);
+static bool ac_propagate_output(ac_automaton_t *ac, uint32_t node);
+static bool ac_stack_push(ac_stack_t *stack, uint32_t node);
 
 /* Implementation */
 
@@ -71,75 +313,402 @@ ac_automaton_t *ac_create(size_t capacity) {
     }
     
     ac->node_capacity = capacity;
-    ac->node_count = 0;
+    ac->node_count = 1;  // Root node, zeroed by calloc
     ac->is_compiled = false;
     
-    // Create root node
-    ac->root = ac_node_create(ac);
-    if (!ac->root) {
-        ac_destroy(ac);
-        return NULL;
-    }
-    
     return ac;
 }
 
 void ac_destroy(ac_automaton_t *ac) {
     if (!ac) return;
     
+    ac_release_image(ac);
     free(ac->nodes);
     free(ac);
 }
 
-static ac_node_t *ac_node_create(ac_automaton_t *ac) {
+static void ac_release_image(ac_automaton_t *ac) {
+    if (ac->owns_image && ac->mapped_size) {
+        munmap((void *)ac->image, ac->mapped_size);
+    } else if (ac->owns_image) {
+        free((void *)ac->image);
+    }
+    ac->mapped_size = 0;
+    free(ac->user_data);
+    free(ac->pattern_nodes);
+    ac->image = NULL;
+    ac->owns_image = false;
+    ac->user_data = NULL;
+    ac->pattern_nodes = NULL;
+    ac->pattern_count = 0;
+}
+
+/* Drop the trie of a compiled automaton; it is then counted like a loaded image */
+static void ac_release_trie(ac_automaton_t *ac) {
+    free(ac->nodes);
+    free(ac->pattern_nodes);
+    ac->nodes = NULL;
+    ac->pattern_nodes = NULL;
+    ac->node_capacity = 0;
+    ac->node_count = ac->image ? ((const ac_image_header_t *)ac->image)->state_count : 0;
+    ac->free_list = AC_ROOT;
+    ac->free_count = 0;
+}
+
+static bool ac_node_create(ac_automaton_t *ac, uint32_t *index) {
+    // Reuse slots of removed nodes first
+    if (ac->free_list != AC_ROOT) {
+        uint32_t reused = ac->free_list;
+        ac->free_list = ac->nodes[reused].fail_next;
+        ac->free_count--;
+        memset(&ac->nodes[reused], 0, sizeof(ac_node_t));
+        ac->nodes[reused].node_id = reused;
+        *index = reused;
+        return true;
+    }
+
     if (ac->node_count >= ac->node_capacity) {
-        return NULL; // Could implement reallocation here
+        // Links are indices, so the pool can move
+        size_t new_capacity = ac->node_capacity ? ac->node_capacity * 2 : AC_DEFAULT_NODE_CAPACITY;
+        if (new_capacity > UINT32_MAX) return false;
+
+        ac_node_t *new_nodes = realloc(ac->nodes, new_capacity * sizeof(ac_node_t));
+        if (!new_nodes) return false;
+
+        ac->nodes = new_nodes;
+        ac->node_capacity = new_capacity;
     }
     
     ac_node_t *node = &ac->nodes[ac->node_count];
     memset(node, 0, sizeof(ac_node_t));
-    node->node_id = ac->node_count;
+    node->node_id = (uint32_t)ac->node_count;
+    *index = node->node_id;
     ac->node_count++;
     
-    return node;
+    return true;
+}
+
+/* Unlinked leaf slots are chained through fail_next */
+static void ac_node_free(ac_automaton_t *ac, uint32_t index) {
+    memset(&ac->nodes[index], 0, sizeof(ac_node_t));
+    ac->nodes[index].node_id = index;
+    ac->nodes[index].fail_next = ac->free_list;
+    ac->free_list = index;
+    ac->free_count++;
+}
+
+/*
+ * Walk the trie along the pattern, creating missing nodes; AC_ROOT on failure.
+ * On a compiled automaton each new node gets its links repaired on the spot.
+ */
+static uint32_t ac_insert_path(ac_automaton_t *ac, const char *pattern, size_t pattern_len) {
+    uint32_t current = AC_ROOT;
+    
+    for (size_t i = 0; i < pattern_len; i++) {
+        unsigned char c = ac_fold(ac, (unsigned char)pattern[i]);
+        uint32_t child = ac->nodes[current].children[c];
+        
+        if (child == AC_ROOT) {
+            if (!ac_node_create(ac, &child)) {
+                return AC_ROOT;
+            }
+            ac->nodes[current].children[c] = child;
+            ac->nodes[current].child_count++;
+            ac->nodes[child].parent = current;
+            ac->nodes[child].label = c;
+
+            if (ac->is_compiled && !ac_link_new_node(ac, child)) {
+                // Links are half repaired: rebuild them all on the next compile
+                ac->is_compiled = false;
+                return AC_ROOT;
+            }
+        }
+        
+        current = child;
+    }
+    
+    return current;
+}
+
+/*
+ * Incremental maintenance of a compiled automaton
+ *
+ * Once compiled, every node also sits in the inverse failure tree (the nodes
+ * whose failure link points at it), so a change only visits the part of the
+ * automaton it can affect instead of rebuilding all links:
+ *
+ *  - a new node v = child(p, c) can only become the failure target of
+ *    c-children of nodes below p in the failure tree, and only down to the
+ *    first such node on each branch;
+ *  - a node that starts or stops ending a pattern only changes the output
+ *    links below it in the failure tree, down to the next pattern end.
+ *
+ * Changes drop the search image; searches then run on the linked trie until
+ * ac_compile flattens it again. That flattening is not incremental: it
+ * rebuilds the whole image, only skipping the failure links, which are
+ * already repaired.
+ */
+static bool ac_stack_push(ac_stack_t *stack, uint32_t node) {
+    if (stack->count == stack->capacity) {
+        size_t new_capacity = stack->capacity ? stack->capacity * 2 : 64;
+        uint32_t *items = realloc(stack->items, new_capacity * sizeof(uint32_t));
+        if (!items) return false;
+        stack->items = items;
+        stack->capacity = new_capacity;
+    }
+    stack->items[stack->count++] = node;
+    return true;
+}
+
+static void ac_fail_attach(ac_node_t *nodes, uint32_t node, uint32_t failure) {
+    nodes[node].failure = failure;
+    nodes[node].fail_prev = AC_ROOT;
+    nodes[node].fail_next = nodes[failure].fail_child;
+    if (nodes[failure].fail_child != AC_ROOT) {
+        nodes[nodes[failure].fail_child].fail_prev = node;
+    }
+    nodes[failure].fail_child = node;
+}
+
+static void ac_fail_detach(ac_node_t *nodes, uint32_t node) {
+    uint32_t prev = nodes[node].fail_prev;
+    uint32_t next = nodes[node].fail_next;
+
+    if (prev != AC_ROOT) {
+        nodes[prev].fail_next = next;
+    } else {
+        nodes[nodes[node].failure].fail_child = next;
+    }
+    if (next != AC_ROOT) {
+        nodes[next].fail_prev = prev;
+    }
+    nodes[node].fail_prev = AC_ROOT;
+    nodes[node].fail_next = AC_ROOT;
+}
+
+/* Recompute output links below node in the failure tree, stopping at pattern ends */
+static bool ac_propagate_output(ac_automaton_t *ac, uint32_t node) {
+    ac_node_t *nodes = ac->nodes;
+    ac_stack_t stack = { NULL, 0, 0 };
+    bool ok = ac_stack_push(&stack, node);
+
+    while (ok && stack.count > 0) {
+        uint32_t current = stack.items[--stack.count];
+        uint32_t output = nodes[current].is_end ? current : nodes[current].output;
+
+        for (uint32_t child = nodes[current].fail_child; child != AC_ROOT; child = nodes[child].fail_next) {
+            if (nodes[child].output == output) continue;
+            nodes[child].output = output;
+            if (!nodes[child].is_end && !ac_stack_push(&stack, child)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    free(stack.items);
+    return ok;
+}
+
+/* Give a node just added to a compiled trie its links, and take over the nodes it is now the longest suffix of */
+static bool ac_link_new_node(ac_automaton_t *ac, uint32_t node) {
+    ac_node_t *nodes = ac->nodes;
+    uint32_t parent = nodes[node].parent;
+    unsigned char c = nodes[node].label;
+    uint32_t failure = AC_ROOT;
+
+    if (parent != AC_ROOT) {
+        failure = nodes[parent].failure;
+        while (failure != AC_ROOT && nodes[failure].children[c] == AC_ROOT) {
+            failure = nodes[failure].failure;
+        }
+        failure = nodes[failure].children[c];
+    }
+    ac_fail_attach(nodes, node, failure);
+    nodes[node].output = nodes[failure].is_end ? failure : nodes[failure].output;
+
+    // Nodes ending in parent's string, nearest first: the first one on each
+    // branch with a c-child hands that child over; deeper ones keep a
+    // longer failure through it
+    ac_stack_t stack = { NULL, 0, 0 };
+    bool ok = true;
+    for (uint32_t child = nodes[parent].fail_child; ok && child != AC_ROOT; child = nodes[child].fail_next) {
+        ok = ac_stack_push(&stack, child);
+    }
+    while (ok && stack.count > 0) {
+        uint32_t current = stack.items[--stack.count];
+        uint32_t target = nodes[current].children[c];
+
+        if (target != AC_ROOT) {
+            ac_fail_detach(nodes, target);
+            ac_fail_attach(nodes, target, node);
+            nodes[target].output = nodes[node].output;
+            ok = ac_propagate_output(ac, target);
+            continue;
+        }
+        for (uint32_t child = nodes[current].fail_child; ok && child != AC_ROOT; child = nodes[child].fail_next) {
+            ok = ac_stack_push(&stack, child);
+        }
+    }
+    free(stack.items);
+    return ok;
+}
+
+/* Find the node spelling pattern, AC_ROOT if there is none */
+static uint32_t ac_find_node(const ac_automaton_t *ac, const char *pattern, size_t pattern_len) {
+    uint32_t current = AC_ROOT;
+
+    for (size_t i = 0; i < pattern_len; i++) {
+        current = ac->nodes[current].children[ac_fold(ac, (unsigned char)pattern[i])];
+        if (current == AC_ROOT) break;
+    }
+    return current;
+}
+
+bool ac_remove_pattern(ac_automaton_t *ac, const char *pattern, size_t pattern_len) {
+    if (!ac || !ac->nodes || !pattern) return false;
+
+    if (pattern_len == 0) pattern_len = strlen(pattern);
+    if (pattern_len == 0) return false;
+
+    uint32_t index = ac_find_node(ac, pattern, pattern_len);
+    if (index == AC_ROOT || !ac->nodes[index].is_end) return false;
+
+    ac_node_t *nodes = ac->nodes;
+    nodes[index].is_end = false;
+    nodes[index].pattern = NULL;
+    nodes[index].replacement = NULL;
+    nodes[index].pattern_len = 0;
+    nodes[index].replacement_len = 0;
+    nodes[index].user_data = NULL;
+    nodes[index].left_boundary = AC_BOUNDARY_NONE;
+    nodes[index].right_boundary = AC_BOUNDARY_NONE;
+    nodes[index].contexts = 0;
+    ac->trie_pattern_count--;
+
+    if (ac->is_compiled) {
+        ac_release_image(ac);
+        if (!ac_propagate_output(ac, index)) {
+            // Out of memory mid-repair: fall back to a full rebuild on the next compile
+            ac->is_compiled = false;
+        }
+    }
+
+    // Drop the branch that now leads to no pattern
+    while (index != AC_ROOT && !nodes[index].is_end && nodes[index].child_count == 0) {
+        uint32_t parent = nodes[index].parent;
+
+        nodes[parent].children[nodes[index].label] = AC_ROOT;
+        nodes[parent].child_count--;
+
+        if (ac->is_compiled) {
+            // Nodes failing here fall back to the next shorter suffix; as
+            // this node ends no pattern, their output links stay the same
+            uint32_t failure = nodes[index].failure;
+            while (nodes[index].fail_child != AC_ROOT) {
+                uint32_t child = nodes[index].fail_child;
+                ac_fail_detach(nodes, child);
+                ac_fail_attach(nodes, child, failure);
+            }
+            ac_fail_detach(nodes, index);
+        }
+        ac_node_free(ac, index);
+        index = parent;
+    }
+
+    return true;
+}
+
+bool ac_set_keep_trie(ac_automaton_t *ac, bool keep) {
+    if (!ac || (keep && !ac->nodes)) return false;
+
+    ac->keep_trie = keep;
+    return true;
+}
+
+bool ac_set_case_insensitive(ac_automaton_t *ac, bool enabled) {
+    if (!ac || !ac->nodes || ac->node_count - ac->free_count > 1) return false;
+
+    ac_release_image(ac);
+    ac->case_insensitive = enabled;
+    ac->is_compiled = false;
+    return true;
+}
+
+bool ac_set_boundaries(ac_automaton_t *ac, const char *pattern, size_t pattern_len,
+                       ac_boundary_t left, ac_boundary_t right) {
+    if (!ac || !ac->nodes || !pattern) return false;
+    if ((unsigned)left > AC_BOUNDARY_MAX || (unsigned)right > AC_BOUNDARY_MAX) return false;
+
+    if (pattern_len == 0) pattern_len = strlen(pattern);
+    if (pattern_len == 0) return false;
+
+    uint32_t index = ac_find_node(ac, pattern, pattern_len);
+    if (index == AC_ROOT || !ac->nodes[index].is_end) return false;
+
+    // Links are unaffected; only the image carries a copy
+    ac_release_image(ac);
+    ac->nodes[index].left_boundary = (uint8_t)left;
+    ac->nodes[index].right_boundary = (uint8_t)right;
+    return true;
+}
+
+bool ac_set_contexts(ac_automaton_t *ac, const char *pattern, size_t pattern_len,
+                     unsigned contexts) {
+    if (!ac || !ac->nodes || !pattern || (contexts & ~(unsigned)AC_CONTEXT_ALL)) return false;
+
+    if (pattern_len == 0) pattern_len = strlen(pattern);
+    if (pattern_len == 0) return false;
+
+    uint32_t index = ac_find_node(ac, pattern, pattern_len);
+    if (index == AC_ROOT || !ac->nodes[index].is_end) return false;
+
+    ac_release_image(ac);
+    ac->nodes[index].contexts = (uint8_t)contexts;
+    if (contexts) ac->html_contexts = true;
+    return true;
+}
+
+bool ac_boundaries_hold(const char *text, size_t text_len, size_t start_pos, size_t end_pos,
+                        ac_boundary_t left, ac_boundary_t right) {
+    if (!text || end_pos < start_pos || end_pos >= text_len) return false;
+    return ac_check_boundaries(text, text_len, start_pos, end_pos, left, right);
 }
 
 bool ac_add_pattern(ac_automaton_t *ac, 
                     const char *pattern, size_t pattern_len,
                     const char *replacement, size_t replacement_len) {
-    if (!ac || !pattern || !replacement) return false;
+    if (!ac || !ac->nodes || !pattern || !replacement) return false;
     
     if (pattern_len == 0) pattern_len = strlen(pattern);
     if (replacement_len == 0) replacement_len = strlen(replacement);
     if (pattern_len == 0) return false;
     
-    // Reset compilation status
-    ac->is_compiled = false;
-    
-    ac_node_t *current = ac->root;
+    // A compiled automaton is repaired in place; the image goes stale
+    ac_release_image(ac);
     
     // Traverse/create path for pattern
-    for (size_t i = 0; i < pattern_len; i++) {
-        unsigned char c = (unsigned char)pattern[i];
-        
-        if (!current->children[c]) {
-            current->children[c] = ac_node_create(ac);
-            if (!current->children[c]) {
-                return false;
-            }
-        }
-        
-        current = current->children[c];
+    uint32_t index = ac_insert_path(ac, pattern, pattern_len);
+    if (index == AC_ROOT) {
+        return false;
     }
+    ac_node_t *current = &ac->nodes[index];
     
     // Mark as end node and set pattern/replacement
+    bool was_end = current->is_end;
     current->is_end = true;
     current->pattern = pattern;
     current->pattern_len = pattern_len;
     current->replacement = replacement;
     current->replacement_len = replacement_len;
     current->user_data = NULL;  // Initialize user_data to NULL
+    current->left_boundary = AC_BOUNDARY_NONE;
+    current->right_boundary = AC_BOUNDARY_NONE;
+    current->contexts = 0;
 
+    if (!was_end) ac->trie_pattern_count++;
+    if (ac->is_compiled && !was_end && !ac_propagate_output(ac, index)) {
+        ac->is_compiled = false;
+    }
     return true;
 }
 
@@ -147,144 +716,749 @@ bool ac_add_pattern_ex(ac_automaton_t *ac,
                        const char *pattern, size_t pattern_len,
                        const char *replacement, size_t replacement_len,
                        void *user_data) {
-    if (!ac || !pattern) return false;
+    if (!ac || !ac->nodes || !pattern) return false;
 
     if (pattern_len == 0) pattern_len = strlen(pattern);
     if (replacement && replacement_len == 0) replacement_len = strlen(replacement);
     if (pattern_len == 0) return false;
 
-    // Reset compilation status
-    ac->is_compiled = false;
-
-    ac_node_t *current = ac->root;
+    // A compiled automaton is repaired in place; the image goes stale
+    ac_release_image(ac);
 
     // Traverse/create path for pattern
-    for (size_t i = 0; i < pattern_len; i++) {
-        unsigned char c = (unsigned char)pattern[i];
-
-        if (!current->children[c]) {
-            current->children[c] = ac_node_create(ac);
-            if (!current->children[c]) {
-                return false;
-            }
-        }
-
-        current = current->children[c];
+    uint32_t index = ac_insert_path(ac, pattern, pattern_len);
+    if (index == AC_ROOT) {
+        return false;
     }
+    ac_node_t *current = &ac->nodes[index];
 
     // Mark as end node and set pattern/replacement/user_data
+    bool was_end = current->is_end;
     current->is_end = true;
     current->pattern = pattern;
     current->pattern_len = pattern_len;
     current->replacement = replacement;  // Can be NULL when using callback
     current->replacement_len = replacement_len;
     current->user_data = user_data;
+    current->left_boundary = AC_BOUNDARY_NONE;
+    current->right_boundary = AC_BOUNDARY_NONE;
+    current->contexts = 0;
 
+    if (!was_end) ac->trie_pattern_count++;
+    if (ac->is_compiled && !was_end && !ac_propagate_output(ac, index)) {
+        ac->is_compiled = false;
+    }
     return true;
 }
 
 bool ac_compile(ac_automaton_t *ac) {
-    if (!ac || ac->is_compiled) return false;
+    if (!ac) return false;
+    if (ac->is_compiled && ac->image) return true;
+    if (!ac->nodes) return false;
     
-    ac_build_failure_links(ac);
+    // Links repaired by incremental changes are current; only the layout is needed
+    size_t state_count = 0;
+    uint32_t *order = ac->is_compiled ? ac_bfs_order(ac, &state_count)
+                                      : ac_build_failure_links(ac, &state_count);
+    if (!order) return false;
+
+    bool built = ac_build_image(ac, order, state_count);
+    free(order);
+    if (!built) return false;
+
     ac->is_compiled = true;
+
+    if (!ac->keep_trie) {
+        ac_release_trie(ac);
+        return true;
+    }
+
+    // Right-size the pool; a failed shrink just keeps the larger block
+    if (ac->node_count < ac->node_capacity) {
+        ac_node_t *trimmed = realloc(ac->nodes, ac->node_count * sizeof(ac_node_t));
+        if (trimmed) {
+            ac->nodes = trimmed;
+            ac->node_capacity = ac->node_count;
+        }
+    }
     return true;
 }
 
-static void ac_build_failure_links(ac_automaton_t *ac) {
-    ac_queue_t *queue = ac_queue_create(ac->node_count);
-    if (!queue) return;
+/* Build failure and output links; returns the nodes in BFS order (root first) */
+static uint32_t *ac_build_failure_links(ac_automaton_t *ac, size_t *state_count) {
+    ac_node_t *nodes = ac->nodes;
+    uint32_t *order = malloc(ac->node_count * sizeof(uint32_t));
+    if (!order) return NULL;
+
+    // The inverse failure tree is rebuilt along with the links
+    for (size_t i = 0; i < ac->node_count; i++) {
+        nodes[i].fail_child = AC_ROOT;
+    }
+
+    // The BFS order array doubles as the queue
+    size_t head = 1, tail = 1;
+    order[0] = AC_ROOT;
     
     // Initialize failure links for depth 1 nodes (root's children)
     for (int i = 0; i < AC_MAX_ALPHABET_SIZE; i++) {
-        if (ac->root->children[i]) {
-            ac->root->children[i]->failure = ac->root;
-            ac_queue_push(queue, ac->root->children[i]);
+        uint32_t child = nodes[AC_ROOT].children[i];
+        if (child != AC_ROOT) {
+            ac_fail_attach(nodes, child, AC_ROOT);
+            nodes[child].output = AC_ROOT;
+            order[tail++] = child;
         }
     }
     
     // Build failure links using BFS
-    while (!ac_queue_empty(queue)) {
-        ac_node_t *current = ac_queue_pop(queue);
+    while (head < tail) {
+        uint32_t current = order[head++];
         
         for (int i = 0; i < AC_MAX_ALPHABET_SIZE; i++) {
-            ac_node_t *child = current->children[i];
-            if (!child) continue;
-            
-            ac_queue_push(queue, child);
+            uint32_t child = nodes[current].children[i];
+            if (child == AC_ROOT) continue;
             
-            // Find failure link for this child
-            ac_node_t *failure = current->failure;
+            order[tail++] = child;
             
-            while (failure && !failure->children[i]) {
-                failure = failure->failure;
-            }
+            // Find failure link for this child: longest proper suffix in the trie
+            uint32_t failure = nodes[current].failure;
             
-            if (failure) {
-                child->failure = failure->children[i];
-            } else {
-                child->failure = ac->root;
+            while (failure != AC_ROOT && nodes[failure].children[i] == AC_ROOT) {
+                failure = nodes[failure].failure;
             }
+            ac_fail_attach(nodes, child, nodes[failure].children[i]);
             
             // Build output links
-            if (child->failure->is_end) {
-                child->output = child->failure;
+            uint32_t target = nodes[child].failure;
+            nodes[child].output = nodes[target].is_end ? target : nodes[target].output;
+        }
+    }
+    
+    *state_count = tail;
+    return order;
+}
+
+/* The nodes in BFS order (root first), the image's state layout */
+static uint32_t *ac_bfs_order(const ac_automaton_t *ac, size_t *state_count) {
+    const ac_node_t *nodes = ac->nodes;
+    uint32_t *order = malloc(ac->node_count * sizeof(uint32_t));
+    if (!order) return NULL;
+
+    size_t head = 0, tail = 1;
+    order[0] = AC_ROOT;
+    while (head < tail) {
+        uint32_t current = order[head++];
+        for (int i = 0; i < AC_MAX_ALPHABET_SIZE; i++) {
+            if (nodes[current].children[i] != AC_ROOT) order[tail++] = nodes[current].children[i];
+        }
+    }
+
+    *state_count = tail;
+    return order;
+}
+
+/* Flatten the linked trie into the search image described at the top of this file */
+static bool ac_build_image(ac_automaton_t *ac, const uint32_t *order, size_t state_count) {
+    const ac_node_t *nodes = ac->nodes;
+    size_t node_count = ac->node_count;
+    uint16_t byte_class[AC_MAX_ALPHABET_SIZE];
+    uint8_t used_bytes[AC_MAX_ALPHABET_SIZE];
+    bool used[AC_MAX_ALPHABET_SIZE] = { false };
+    size_t used_count = 0;
+
+    // Bytes that start no transition share class 1 and always lead back to the root
+    for (size_t n = 0; n < node_count; n++) {
+        for (int c = 0; c < AC_MAX_ALPHABET_SIZE; c++) {
+            if (nodes[n].children[c] != AC_ROOT) used[c] = true;
+        }
+    }
+    uint32_t class_count = 1;
+    for (int c = 0; c < AC_MAX_ALPHABET_SIZE; c++) {
+        if (used[c]) {
+            used_bytes[used_count++] = (uint8_t)c;
+            byte_class[c] = (uint16_t)++class_count;
+        } else {
+            byte_class[c] = 1;
+        }
+    }
+    if (ac->case_insensitive) {
+        for (int c = 'A'; c <= 'Z'; c++) {
+            byte_class[c] = byte_class[c + ('a' - 'A')];
+        }
+    }
+    size_t stride = class_count + 1;
+    if ((uint64_t)state_count * stride > UINT32_MAX) return false;
+
+    uint32_t *row = malloc(node_count * sizeof(uint32_t));
+    uint32_t *pattern_id = malloc(node_count * sizeof(uint32_t));
+    if (!row || !pattern_id) {
+        free(row);
+        free(pattern_id);
+        return false;
+    }
+
+    size_t pattern_count = 0;
+    uint64_t string_size = 0;
+    for (size_t i = 0; i < state_count; i++) {
+        uint32_t n = order[i];
+        row[n] = (uint32_t)(i * stride);
+        pattern_id[n] = 0;
+        if (nodes[n].is_end) {
+            pattern_id[n] = (uint32_t)++pattern_count;
+            string_size += nodes[n].pattern_len + 1 + nodes[n].replacement_len + 1;
+        }
+    }
+
+    size_t table_offset = AC_IMAGE_ALIGN(sizeof(ac_image_header_t));
+    size_t pattern_offset = AC_IMAGE_ALIGN(table_offset + state_count * stride * sizeof(uint32_t));
+    size_t string_offset = pattern_offset + pattern_count * sizeof(ac_image_pattern_t);
+    size_t size = AC_IMAGE_ALIGN(string_offset + string_size);
+
+    char *image = string_size <= UINT32_MAX ? calloc(1, size) : NULL;
+    void **user_data = pattern_count ? calloc(pattern_count, sizeof(void *)) : NULL;
+    uint32_t *pattern_nodes = pattern_count ? malloc(pattern_count * sizeof(uint32_t)) : NULL;
+    if (!image || (pattern_count && (!user_data || !pattern_nodes))) {
+        free(image);
+        free(user_data);
+        free(pattern_nodes);
+        free(row);
+        free(pattern_id);
+        return false;
+    }
+
+    ac_image_header_t *header = (ac_image_header_t *)image;
+    header->magic = AC_IMAGE_MAGIC;
+    header->version = AC_IMAGE_VERSION;
+    header->byte_order = AC_IMAGE_BYTE_ORDER;
+    header->flags = ac->case_insensitive ? AC_IMAGE_CASE_INSENSITIVE : 0;
+    header->size = size;
+    header->state_count = (uint32_t)state_count;
+    header->class_count = class_count;
+    header->pattern_count = (uint32_t)pattern_count;
+    header->string_size = (uint32_t)string_size;
+    header->table_offset = table_offset;
+    header->pattern_offset = pattern_offset;
+    header->string_offset = string_offset;
+    memcpy(header->byte_class, byte_class, sizeof(byte_class));
+
+    uint32_t *table = (uint32_t *)(image + table_offset);
+    ac_image_pattern_t *patterns = (ac_image_pattern_t *)(image + pattern_offset);
+    char *strings = image + string_offset;
+    uint32_t string_pos = 0;
+
+    for (size_t i = 0; i < state_count; i++) {
+        uint32_t n = order[i];
+        const ac_node_t *node = &nodes[n];
+        uint32_t *cells = table + row[n];
+
+        // Reported patterns: this node's own, then its output link's chain
+        uint32_t next_output = (n != AC_ROOT && node->output != AC_ROOT) ? pattern_id[node->output] : 0;
+        if (node->is_end) {
+            ac_image_pattern_t *pattern = &patterns[pattern_id[n] - 1];
+
+            pattern->pattern_offset = string_pos;
+            pattern->pattern_len = (uint32_t)node->pattern_len;
+            memcpy(strings + string_pos, node->pattern, node->pattern_len);
+            string_pos += (uint32_t)node->pattern_len + 1;
+
+            pattern->replacement_offset = string_pos;
+            pattern->replacement_len = (uint32_t)node->replacement_len;
+            if (node->replacement) {
+                memcpy(strings + string_pos, node->replacement, node->replacement_len);
+                pattern->flags |= AC_IMAGE_HAS_REPLACEMENT;
+            }
+            pattern->flags |= (uint32_t)node->left_boundary << AC_IMAGE_LEFT_SHIFT |
+                              (uint32_t)node->right_boundary << AC_IMAGE_RIGHT_SHIFT |
+                              (uint32_t)node->contexts << AC_IMAGE_CONTEXT_SHIFT;
+            if (node->contexts) header->flags |= AC_IMAGE_HTML_CONTEXTS;
+            string_pos += (uint32_t)node->replacement_len + 1;
+
+            pattern->next_output = next_output;
+            user_data[pattern_id[n] - 1] = node->user_data;
+            pattern_nodes[pattern_id[n] - 1] = n;
+            cells[0] = pattern_id[n];
+        } else {
+            cells[0] = next_output;
+        }
+
+        // Resolve failure transitions; BFS order guarantees the failure
+        // state's row is already complete
+        cells[1] = 0;
+        for (size_t u = 0; u < used_count; u++) {
+            uint8_t c = used_bytes[u];
+            uint32_t child = node->children[c];
+
+            if (child != AC_ROOT) {
+                cells[byte_class[c]] = row[child];
+            } else if (n == AC_ROOT) {
+                cells[byte_class[c]] = 0;
             } else {
-                child->output = child->failure->output;
+                cells[byte_class[c]] = table[row[node->failure] + byte_class[c]];
             }
         }
     }
-    
-    ac_queue_destroy(queue);
+
+    free(row);
+    free(pattern_id);
+
+    ac_release_image(ac);
+    ac->image = image;
+    ac->owns_image = true;
+    ac->user_data = user_data;
+    ac->pattern_nodes = pattern_nodes;
+    ac->pattern_count = pattern_count;
+    return true;
 }
 
-int ac_search(const ac_automaton_t *ac, 
-              const char *text, size_t text_len,
-              ac_match_callback_t callback, void *user_data) {
-    if (!ac || !text || !callback || !ac->is_compiled) return -1;
-    
-    ac_node_t *current = ac->root;
+size_t ac_image_size(const ac_automaton_t *ac) {
+    if (!ac || !ac->image) return 0;
+    return (size_t)((const ac_image_header_t *)ac->image)->size;
+}
+
+bool ac_relocate_image(ac_automaton_t *ac, void *dest, size_t dest_size) {
+    if (!ac || !ac->image || !dest || ((uintptr_t)dest & 7)) return false;
+
+    size_t size = ac_image_size(ac);
+    if (dest_size < size) return false;
+
+    memcpy(dest, ac->image, size);
+    if (ac->owns_image && ac->mapped_size) {
+        munmap((void *)ac->image, ac->mapped_size);
+    } else if (ac->owns_image) {
+        free((void *)ac->image);
+    }
+    ac->image = dest;
+    ac->owns_image = false;
+    ac->mapped_size = 0;
+
+    // The image is self-contained; the trie is only needed to add patterns
+    ac_release_trie(ac);
+    return true;
+}
+
+/* 64-bit FNV-1a over the image in 8-byte words, with the checksum field read as zero */
+static uint64_t ac_image_checksum(const ac_image_header_t *image) {
+    const uint64_t *word = (const uint64_t *)image;
+    const uint64_t *checksum_field = &image->checksum;
+    size_t words = (size_t)(image->size / sizeof(uint64_t));
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < words; i++) {
+        hash ^= (word + i == checksum_field) ? 0 : word[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * A match is reported pattern_len bytes back from where it ends, so no state
+ * may report a pattern longer than the fewest bytes that reach it: its BFS
+ * distance from the root. Output chains are checked to shorten at every
+ * step, so bounding the first pattern of each state bounds them all.
+ */
+static bool ac_image_depths_valid(const ac_image_header_t *image) {
+    const uint32_t *table = AC_IMAGE_AT(image, image->table_offset, const uint32_t *);
+    const ac_image_pattern_t *patterns = AC_IMAGE_AT(image, image->pattern_offset, const ac_image_pattern_t *);
+    uint32_t stride = image->class_count + 1;
+    uint32_t *depth = malloc(image->state_count * sizeof(uint32_t));
+    uint32_t *queue = malloc(image->state_count * sizeof(uint32_t));
+    size_t head = 0, tail = 0;
+    bool valid = depth && queue;
+
+    if (valid) {
+        memset(depth, 0xff, image->state_count * sizeof(uint32_t));
+        depth[0] = 0;
+        queue[tail++] = 0;
+    }
+    while (valid && head < tail) {
+        uint32_t state = queue[head++];
+        const uint32_t *cells = table + (size_t)state * stride;
+
+        if (cells[0] && patterns[cells[0] - 1].pattern_len > depth[state]) {
+            valid = false;
+        }
+        for (uint32_t c = 1; c < stride; c++) {
+            uint32_t next = cells[c] / stride;
+            if (depth[next] == UINT32_MAX) {
+                depth[next] = depth[state] + 1;
+                queue[tail++] = next;
+            }
+        }
+    }
+    free(depth);
+    free(queue);
+    return valid;
+}
+
+/* Bounds-check every offset the search follows, so a damaged file cannot send it out of the image */
+static bool ac_image_valid(const ac_image_header_t *image, size_t size) {
+    if (size < sizeof(ac_image_header_t) ||
+        image->magic != AC_IMAGE_MAGIC ||
+        image->byte_order != AC_IMAGE_BYTE_ORDER ||
+        image->version != AC_IMAGE_VERSION ||
+        (image->flags & ~(uint32_t)(AC_IMAGE_CASE_INSENSITIVE | AC_IMAGE_HTML_CONTEXTS)) != 0 ||
+        image->size != size || (size & 7) != 0) {
+        return false;
+    }
+
+    uint64_t stride = (uint64_t)image->class_count + 1;
+    uint64_t cells = (uint64_t)image->state_count * stride;
+    if (image->table_offset > size || image->pattern_offset > size ||
+        image->string_offset > size || image->state_count == 0 || image->class_count == 0 ||
+        image->class_count > AC_MAX_ALPHABET_SIZE + 1 ||
+        image->table_offset < sizeof(ac_image_header_t) || (image->table_offset & 3) != 0 ||
+        image->table_offset + cells * sizeof(uint32_t) > image->pattern_offset ||
+        (image->pattern_offset & 3) != 0 ||
+        image->pattern_offset + (uint64_t)image->pattern_count * sizeof(ac_image_pattern_t) > image->string_offset ||
+        image->string_offset + image->string_size > size) {
+        return false;
+    }
+
+    for (int c = 0; c < AC_MAX_ALPHABET_SIZE; c++) {
+        if (image->byte_class[c] == 0 || image->byte_class[c] > image->class_count) return false;
+    }
+
+    const uint32_t *table = AC_IMAGE_AT(image, image->table_offset, const uint32_t *);
+    for (uint64_t i = 0; i < cells; i++) {
+        if (i % stride == 0) {
+            if (table[i] > image->pattern_count) return false;
+        } else if (table[i] >= cells || table[i] % stride != 0) {
+            return false;
+        }
+    }
+
+    const ac_image_pattern_t *patterns = AC_IMAGE_AT(image, image->pattern_offset, const ac_image_pattern_t *);
+    const char *strings = AC_IMAGE_AT(image, image->string_offset, const char *);
+    for (uint32_t i = 0; i < image->pattern_count; i++) {
+        const ac_image_pattern_t *pattern = &patterns[i];
+        if (pattern->next_output > image->pattern_count ||
+            pattern->pattern_len == 0 || pattern->pattern_len > image->string_size ||
+            (pattern->next_output &&
+             patterns[pattern->next_output - 1].pattern_len >= pattern->pattern_len) ||
+            (uint64_t)pattern->pattern_offset + pattern->pattern_len >= image->string_size ||
+            (uint64_t)pattern->replacement_offset + pattern->replacement_len >= image->string_size ||
+            strings[pattern->pattern_offset + pattern->pattern_len] != '\0' ||
+            strings[pattern->replacement_offset + pattern->replacement_len] != '\0' ||
+            (pattern->flags & ~(AC_IMAGE_HAS_REPLACEMENT | AC_IMAGE_BOUNDED |
+                                (uint32_t)AC_CONTEXT_ALL << AC_IMAGE_CONTEXT_SHIFT)) != 0 ||
+            ((pattern->flags >> AC_IMAGE_LEFT_SHIFT) & 0xff) > AC_BOUNDARY_MAX ||
+            ((pattern->flags >> AC_IMAGE_RIGHT_SHIFT) & 0xff) > AC_BOUNDARY_MAX) {
+            return false;
+        }
+    }
+    return ac_image_depths_valid(image);
+}
+
+/* Write all of buf to fd, resuming after short writes */
+static bool ac_write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/*
+ * The image is written to a temporary file next to path and renamed over it,
+ * so processes that have the old file mapped keep their pages and a crash
+ * leaves either the old file or the new one, never a truncated image.
+ */
+bool ac_save(const ac_automaton_t *ac, const char *path) {
+    if (!ac || !ac->image || !path) return false;
+
+    const ac_image_header_t *image = ac->image;
+    ac_image_header_t header = *image;
+    header.checksum = ac_image_checksum(image);
+
+    size_t path_len = strlen(path);
+    char *temp_path = malloc(path_len + sizeof(".XXXXXX"));
+    if (!temp_path) return false;
+    memcpy(temp_path, path, path_len);
+    memcpy(temp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        free(temp_path);
+        return false;
+    }
+
+    // mkstemp creates the file private to its owner; keep the mode of the
+    // file being replaced, or make a new one readable by the server
+    struct stat info;
+    mode_t mode = stat(path, &info) == 0 ? (info.st_mode & 07777) : 0644;
+
+    const char *body = (const char *)image + sizeof(header);
+    size_t body_size = (size_t)image->size - sizeof(header);
+    bool written = fchmod(fd, mode) == 0 &&
+                   ac_write_all(fd, &header, sizeof(header)) &&
+                   ac_write_all(fd, body, body_size) &&
+                   fsync(fd) == 0;
+    if (close(fd) != 0) written = false;
+    if (written) written = rename(temp_path, path) == 0;
+    if (!written) remove(temp_path);
+    free(temp_path);
+    return written;
+}
+
+ac_automaton_t *ac_load(const char *path) {
+    if (!path) return NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(ac_image_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)info.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    const ac_image_header_t *image = mapping;
+    ac_automaton_t *ac = NULL;
+    if (ac_image_valid(image, size) && ac_image_checksum(image) == image->checksum) {
+        ac = calloc(1, sizeof(ac_automaton_t));
+    }
+    void **user_data = (ac && image->pattern_count) ?
+                       calloc(image->pattern_count, sizeof(void *)) : NULL;
+    if (!ac || (image->pattern_count && !user_data)) {
+        free(ac);
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    // No trie: the loaded automaton is compiled and read-only until ac_reset
+    ac->node_count = image->state_count;
+    ac->image = mapping;
+    ac->owns_image = true;
+    ac->mapped_size = size;
+    ac->user_data = user_data;
+    ac->pattern_count = image->pattern_count;
+    ac->case_insensitive = (image->flags & AC_IMAGE_CASE_INSENSITIVE) != 0;
+    ac->is_compiled = true;
+    return ac;
+}
+
+bool ac_get_pattern(const ac_automaton_t *ac, size_t pattern_id,
+                    const char **pattern, size_t *pattern_len,
+                    const char **replacement, size_t *replacement_len) {
+    if (!ac || !ac->image || pattern_id >= ac->pattern_count) return false;
+
+    const ac_image_header_t *image = ac->image;
+    const ac_image_pattern_t *entry =
+        AC_IMAGE_AT(image, image->pattern_offset, const ac_image_pattern_t *) + pattern_id;
+    const char *strings = AC_IMAGE_AT(image, image->string_offset, const char *);
+
+    if (pattern) *pattern = strings + entry->pattern_offset;
+    if (pattern_len) *pattern_len = entry->pattern_len;
+    if (replacement) {
+        *replacement = (entry->flags & AC_IMAGE_HAS_REPLACEMENT) ?
+                       strings + entry->replacement_offset : NULL;
+    }
+    if (replacement_len) *replacement_len = entry->replacement_len;
+    return true;
+}
+
+bool ac_set_user_data(ac_automaton_t *ac, size_t pattern_id, void *user_data) {
+    if (!ac || !ac->image || pattern_id >= ac->pattern_count) return false;
+
+    // Per-pattern user data lives beside the image, so loaded images take it too
+    ac->user_data[pattern_id] = user_data;
+
+    // Keep the trie in step so later changes and recompiles preserve it
+    if (ac->nodes && ac->pattern_nodes) {
+        ac->nodes[ac->pattern_nodes[pattern_id]].user_data = user_data;
+    }
+    return true;
+}
+
+/* Search on the linked trie while the image is stale; pattern ids are node indices */
+static int ac_search_trie(const ac_automaton_t *ac,
+                          const char *text, size_t text_len, size_t scan_len,
+                          ac_match_callback_t callback, void *user_data) {
+    const ac_node_t *nodes = ac->nodes;
+    uint32_t state = AC_ROOT;
     int match_count = 0;
-    
-    for (size_t i = 0; i < text_len; i++) {
-        unsigned char c = (unsigned char)text[i];
-        
-        // Follow failure links until we find a valid transition or reach root
-        while (current && !current->children[c]) {
-            current = current->failure;
+    ac_html_t html = { AC_HTML_TEXT, 0, 0 };
+    unsigned context = 0;
+    size_t context_start = 0;  // Where the current context run began
+
+    for (size_t i = 0; i < scan_len; i++) {
+        unsigned char c = ac_fold(ac, (unsigned char)text[i]);
+
+        if (ac->html_contexts) {
+            unsigned byte_context = ac_html_step(&html, text, text_len, i);
+            if (byte_context != context) {
+                context = byte_context;
+                context_start = i;
+            }
         }
-        
-        if (current) {
-            current = current->children[c];
-        } else {
-            current = ac->root;
+
+        while (state != AC_ROOT && nodes[state].children[c] == AC_ROOT) {
+            state = nodes[state].failure;
+        }
+        state = nodes[state].children[c];
+
+        uint32_t id = nodes[state].is_end ? state : nodes[state].output;
+        for (; id != AC_ROOT; id = nodes[id].output) {
+            const ac_node_t *node = &nodes[id];
+            if ((node->left_boundary | node->right_boundary) &&
+                !ac_check_boundaries(text, text_len, i + 1 - node->pattern_len, i,
+                                     node->left_boundary, node->right_boundary)) {
+                continue;
+            }
+            if (node->contexts &&
+                (!(node->contexts & context) || context_start > i + 1 - node->pattern_len)) {
+                continue;
+            }
+            ac_match_t match = {
+                .start_pos = i + 1 - node->pattern_len,
+                .end_pos = i,
+                .pattern = node->pattern,
+                .replacement = node->replacement,
+                .pattern_len = node->pattern_len,
+                .replacement_len = node->replacement_len,
+                .pattern_id = id
+            };
+
+            match_count++;
+            if (!callback(&match, user_data)) {
+                return match_count;
+            }
+        }
+    }
+
+    return match_count;
+}
+
+/*
+ * Search an image with context-restricted patterns: the loop of ac_search
+ * plus one tokenizer step per byte, kept apart so other images do not pay
+ * for it
+ */
+static int ac_search_html(const ac_automaton_t *ac,
+                          const char *text, size_t text_len, size_t scan_len,
+                          ac_match_callback_t callback, void *user_data) {
+    const ac_image_header_t *image = ac->image;
+    const uint32_t *table = AC_IMAGE_AT(image, image->table_offset, const uint32_t *);
+    const ac_image_pattern_t *patterns = AC_IMAGE_AT(image, image->pattern_offset, const ac_image_pattern_t *);
+    const char *strings = AC_IMAGE_AT(image, image->string_offset, const char *);
+    const uint16_t *byte_class = image->byte_class;
+    ac_html_t html = { AC_HTML_TEXT, 0, 0 };
+    unsigned context = 0;
+    size_t context_start = 0;  // Where the current context run began
+    uint32_t state = 0;
+    int match_count = 0;
+
+    for (size_t i = 0; i < scan_len; i++) {
+        unsigned byte_context = ac_html_step(&html, text, text_len, i);
+        if (byte_context != context) {
+            context = byte_context;
+            context_start = i;
+        }
+        state = table[state + byte_class[(unsigned char)text[i]]];
+
+        for (uint32_t id = table[state]; id != 0; id = patterns[id - 1].next_output) {
+            const ac_image_pattern_t *pattern = &patterns[id - 1];
+            size_t start_pos = i + 1 - pattern->pattern_len;
+            uint32_t contexts = pattern->flags >> AC_IMAGE_CONTEXT_SHIFT;
+
+            if (contexts && (!(contexts & context) || context_start > start_pos)) {
+                continue;
+            }
+            if ((pattern->flags & AC_IMAGE_BOUNDED) &&
+                !ac_check_boundaries(text, text_len, start_pos, i,
+                                     (pattern->flags >> AC_IMAGE_LEFT_SHIFT) & 0xff,
+                                     (pattern->flags >> AC_IMAGE_RIGHT_SHIFT) & 0xff)) {
+                continue;
+            }
+            ac_match_t match = {
+                .start_pos = start_pos,
+                .end_pos = i,
+                .pattern = strings + pattern->pattern_offset,
+                .replacement = (pattern->flags & AC_IMAGE_HAS_REPLACEMENT) ?
+                               strings + pattern->replacement_offset : NULL,
+                .pattern_len = pattern->pattern_len,
+                .replacement_len = pattern->replacement_len,
+                .pattern_id = id - 1
+            };
+
+            match_count++;
+            if (!callback(&match, user_data)) {
+                return match_count;
+            }
         }
+    }
+
+    return match_count;
+}
+
+/*
+ * Report the matches ending in the first scan_len bytes of the text. The
+ * bytes after them are only seen by boundary checks and the tokenizer, so a
+ * match ending at scan_len - 1 is judged by the byte that really follows.
+ */
+static int ac_search_prefix(const ac_automaton_t *ac,
+                            const char *text, size_t text_len, size_t scan_len,
+                            ac_match_callback_t callback, void *user_data) {
+    if (!ac->image) return ac_search_trie(ac, text, text_len, scan_len, callback, user_data);
+    if (((const ac_image_header_t *)ac->image)->flags & AC_IMAGE_HTML_CONTEXTS) {
+        return ac_search_html(ac, text, text_len, scan_len, callback, user_data);
+    }
+    
+    const ac_image_header_t *image = ac->image;
+    const uint32_t *table = AC_IMAGE_AT(image, image->table_offset, const uint32_t *);
+    const ac_image_pattern_t *patterns = AC_IMAGE_AT(image, image->pattern_offset, const ac_image_pattern_t *);
+    const char *strings = AC_IMAGE_AT(image, image->string_offset, const char *);
+    const uint16_t *byte_class = image->byte_class;
+    uint32_t state = 0;  // Row offset of the current state, root first
+    int match_count = 0;
+    
+    for (size_t i = 0; i < scan_len; i++) {
+        // One lookup per byte: failure transitions are resolved in the image
+        state = table[state + byte_class[(unsigned char)text[i]]];
         
         // Check for matches at current position
-        ac_node_t *match_node = current;
-        while (match_node) {
-            if (match_node->is_end) {
-                ac_match_t match = {
-                    .start_pos = i + 1 - match_node->pattern_len,
-                    .end_pos = i,
-                    .pattern = match_node->pattern,
-                    .replacement = match_node->replacement,
-                    .pattern_len = match_node->pattern_len,
-                    .replacement_len = match_node->replacement_len
-                };
-                
-                match_count++;
-                if (!callback(&match, user_data)) {
-                    return match_count;
-                }
+        for (uint32_t id = table[state]; id != 0; id = patterns[id - 1].next_output) {
+            const ac_image_pattern_t *pattern = &patterns[id - 1];
+            if ((pattern->flags & AC_IMAGE_BOUNDED) &&
+                !ac_check_boundaries(text, text_len, i + 1 - pattern->pattern_len, i,
+                                     (pattern->flags >> AC_IMAGE_LEFT_SHIFT) & 0xff,
+                                     (pattern->flags >> AC_IMAGE_RIGHT_SHIFT) & 0xff)) {
+                continue;
+            }
+            ac_match_t match = {
+                .start_pos = i + 1 - pattern->pattern_len,
+                .end_pos = i,
+                .pattern = strings + pattern->pattern_offset,
+                .replacement = (pattern->flags & AC_IMAGE_HAS_REPLACEMENT) ?
+                               strings + pattern->replacement_offset : NULL,
+                .pattern_len = pattern->pattern_len,
+                .replacement_len = pattern->replacement_len,
+                .pattern_id = id - 1
+            };
+            
+            match_count++;
+            if (!callback(&match, user_data)) {
+                return match_count;
             }
-            match_node = match_node->output;
         }
     }
     
     return match_count;
 }
 
+int ac_search(const ac_automaton_t *ac, 
+              const char *text, size_t text_len,
+              ac_match_callback_t callback, void *user_data) {
+    if (!ac || !text || !callback || !ac->is_compiled) return -1;
+    return ac_search_prefix(ac, text, text_len, text_len, callback, user_data);
+}
+
 typedef struct {
     ac_match_t *matches;
     size_t count;
@@ -463,16 +1637,19 @@ char *ac_replace_alloc(const ac_automaton_t *ac,
     return result;
 }
 
-char *ac_replace_with_callback(const ac_automaton_t *ac,
-                               const char *text, size_t text_len,
-                               ac_replacement_callback_t callback,
-                               void *context_data,
-                               size_t *result_len) {
-    if (!ac || !text || !result_len || !ac->is_compiled || !callback) return NULL;
+/* Shared by the ac_replace_*callback functions; exactly one callback is set, and only
+ * matches ending within scan_len bytes are replaced */
+static char *ac_replace_matches(const ac_automaton_t *ac,
+                                const char *text, size_t text_len, size_t scan_len,
+                                ac_replacement_callback_t callback,
+                                ac_span_callback_t span_callback,
+                                void *context_data,
+                                size_t *result_len) {
+    if (!ac || !text || !result_len || !ac->is_compiled || scan_len > text_len) return NULL;
 
     // Collect all matches
     match_collector_t collector = {0};
-    int match_count = ac_search(ac, text, text_len, collect_matches, &collector);
+    int match_count = ac_search_prefix(ac, text, text_len, scan_len, collect_matches, &collector);
 
     if (match_count <= 0) {
         char *result = malloc(text_len + 1);
@@ -488,7 +1665,9 @@ char *ac_replace_with_callback(const ac_automaton_t *ac,
     // Sort matches by start position
     qsort(collector.matches, collector.count, sizeof(ac_match_t), compare_matches_asc);
 
-    // First pass: calculate total result length by calling callbacks
+    // First pass: pick the matches to apply, leftmost first, and ask the
+    // callback for their replacements. A declined match leaves room for the
+    // matches overlapping it, so overlaps are resolved here and not later
     size_t total_len = text_len;
     size_t *replacement_lens = malloc(collector.count * sizeof(size_t));
     const char **replacements = malloc(collector.count * sizeof(const char *));
@@ -500,31 +1679,45 @@ char *ac_replace_with_callback(const ac_automaton_t *ac,
         return NULL;
     }
 
+    size_t applied = 0;
+    size_t text_pos = 0;
     for (size_t i = 0; i < collector.count; i++) {
         ac_match_t *match = &collector.matches[i];
 
-        // Get user_data from the automaton node
-        // We need to search the automaton to find the node with this pattern
-        void *user_data = NULL;
-        ac_node_t *current = ac->root;
-        for (size_t j = 0; j < match->pattern_len; j++) {
-            unsigned char c = (unsigned char)match->pattern[j];
-            if (!current || !current->children[c]) break;
-            current = current->children[c];
-        }
-        if (current && current->is_end) {
-            user_data = current->user_data;
-        }
+        // Skip overlapping matches
+        if (match->start_pos < text_pos) continue;
 
-        // Call callback to get replacement
-        size_t repl_len;
-        const char *repl = callback(match->pattern, match->pattern_len,
-                                   user_data, context_data, &repl_len);
+        // User data registered with the pattern
+        void *user_data = ac->image ? ac->user_data[match->pattern_id] :
+                                      ac->nodes[match->pattern_id].user_data;
 
-        replacements[i] = repl;
-        replacement_lens[i] = repl_len;
+        // Static patterns are copied as they are; the rest ask the callback
+        size_t repl_len = 0;
+        const char *repl;
+        ac_match_t span = *match;
+        if (!user_data && match->replacement) {
+            repl = match->replacement;
+            repl_len = match->replacement_len;
+        } else if (span_callback) {
+            repl = span_callback(text, text_len, text_pos, &span,
+                                 user_data, context_data, &repl_len);
+            if (!repl || span.start_pos < text_pos || span.end_pos < span.start_pos ||
+                span.end_pos >= scan_len) {
+                continue;
+            }
+        } else {
+            repl = callback(match->pattern, match->pattern_len,
+                            user_data, context_data, &repl_len);
+            if (!repl) continue;
+        }
+
+        collector.matches[applied] = span;
+        replacements[applied] = repl;
+        replacement_lens[applied] = repl_len;
+        applied++;
 
-        total_len = total_len - match->pattern_len + repl_len;
+        total_len = total_len - (span.end_pos + 1 - span.start_pos) + repl_len;
+        text_pos = span.end_pos + 1;
     }
 
     // Allocate result buffer
@@ -538,14 +1731,11 @@ char *ac_replace_with_callback(const ac_automaton_t *ac,
 
     // Build result string
     size_t result_pos = 0;
-    size_t text_pos = 0;
+    text_pos = 0;
 
-    for (size_t i = 0; i < collector.count; i++) {
+    for (size_t i = 0; i < applied; i++) {
         ac_match_t *match = &collector.matches[i];
 
-        // Skip overlapping matches
-        if (match->start_pos < text_pos) continue;
-
         // Copy text before match
         if (match->start_pos > text_pos) {
             size_t copy_len = match->start_pos - text_pos;
@@ -554,7 +1744,7 @@ char *ac_replace_with_callback(const ac_automaton_t *ac,
         }
 
         // Copy replacement from callback result
-        if (replacements[i] && replacement_lens[i] > 0) {
+        if (replacement_lens[i] > 0) {
             memcpy(result + result_pos, replacements[i], replacement_lens[i]);
             result_pos += replacement_lens[i];
         }
@@ -577,81 +1767,95 @@ char *ac_replace_with_callback(const ac_automaton_t *ac,
     return result;
 }
 
+char *ac_replace_with_callback(const ac_automaton_t *ac,
+                               const char *text, size_t text_len,
+                               ac_replacement_callback_t callback,
+                               void *context_data,
+                               size_t *result_len) {
+    if (!callback) return NULL;
+    return ac_replace_matches(ac, text, text_len, text_len, callback, NULL, context_data, result_len);
+}
+
+char *ac_replace_with_span_callback(const ac_automaton_t *ac,
+                                    const char *text, size_t text_len,
+                                    ac_span_callback_t callback,
+                                    void *context_data,
+                                    size_t *result_len) {
+    if (!callback) return NULL;
+    return ac_replace_matches(ac, text, text_len, text_len, NULL, callback, context_data, result_len);
+}
+
+char *ac_replace_prefix_with_span_callback(const ac_automaton_t *ac,
+                                           const char *text, size_t text_len, size_t scan_len,
+                                           ac_span_callback_t callback,
+                                           void *context_data,
+                                           size_t *result_len) {
+    if (!callback) return NULL;
+    return ac_replace_matches(ac, text, text_len, scan_len, NULL, callback, context_data, result_len);
+}
+
 void ac_get_stats(const ac_automaton_t *ac,
                   size_t *node_count, size_t *pattern_count, size_t *memory_usage) {
     if (!ac) return;
     
-    if (node_count) *node_count = ac->node_count;
+    if (node_count) *node_count = ac->node_count - ac->free_count;
     
     if (pattern_count) {
-        size_t count = 0;
-        for (size_t i = 0; i < ac->node_count; i++) {
-            if (ac->nodes[i].is_end) count++;
-        }
-        *pattern_count = count;
+        *pattern_count = ac->image ? ac->pattern_count : ac->trie_pattern_count;
     }
     
     if (memory_usage) {
-        *memory_usage = sizeof(ac_automaton_t) + 
-                       (ac->node_capacity * sizeof(ac_node_t));
+        ac_memory_stats_t stats;
+        ac_get_memory_stats(ac, &stats);
+        *memory_usage = sizeof(ac_automaton_t) + stats.trie_bytes + stats.image_bytes + stats.table_bytes;
     }
 }
 
-void ac_reset(ac_automaton_t *ac) {
+void ac_get_memory_stats(const ac_automaton_t *ac, ac_memory_stats_t *stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(ac_memory_stats_t));
     if (!ac) return;
-    
-    memset(ac->nodes, 0, ac->node_capacity * sizeof(ac_node_t));
-    ac->node_count = 0;
-    ac->is_compiled = false;
-    
-    // Recreate root
-    ac->root = ac_node_create(ac);
-}
 
-/* Queue implementation for BFS */
-
-static ac_queue_t *ac_queue_create(size_t capacity) {
-    ac_queue_t *queue = malloc(sizeof(ac_queue_t));
-    if (!queue) return NULL;
-    
-    queue->nodes = malloc(capacity * sizeof(ac_node_t *));
-    if (!queue->nodes) {
-        free(queue);
-        return NULL;
+    if (ac->nodes) {
+        stats->trie_bytes = (ac->node_count - ac->free_count) * sizeof(ac_node_t);
     }
-    
-    queue->front = 0;
-    queue->rear = 0;
-    queue->capacity = capacity;
-    
-    return queue;
-}
+    stats->state_count = ac->node_count - ac->free_count;
+    stats->pattern_count = ac->trie_pattern_count;
 
-static void ac_queue_destroy(ac_queue_t *queue) {
-    if (!queue) return;
-    free(queue->nodes);
-    free(queue);
-}
+    if (ac->image) {
+        const ac_image_header_t *image = ac->image;
 
-static bool ac_queue_push(ac_queue_t *queue, ac_node_t *node) {
-    if (!queue || !node) return false;
-    
-    size_t next_rear = (queue->rear + 1) % queue->capacity;
-    if (next_rear == queue->front) return false; // Queue full
-    
-    queue->nodes[queue->rear] = node;
-    queue->rear = next_rear;
-    return true;
+        stats->state_count = image->state_count;
+        stats->class_count = image->class_count;
+        stats->pattern_count = image->pattern_count;
+        stats->transition_bytes = (size_t)image->state_count * (image->class_count + 1) * sizeof(uint32_t);
+        stats->output_bytes = (size_t)image->pattern_count * sizeof(ac_image_pattern_t);
+        stats->string_bytes = image->string_size;
+        stats->image_bytes = (size_t)image->size;
+        stats->table_bytes = ac->pattern_count * sizeof(void *) +
+                             (ac->pattern_nodes ? ac->pattern_count * sizeof(uint32_t) : 0);
+    }
 }
 
-static ac_node_t *ac_queue_pop(ac_queue_t *queue) {
-    if (!queue || ac_queue_empty(queue)) return NULL;
+void ac_reset(ac_automaton_t *ac) {
+    if (!ac) return;
     
-    ac_node_t *node = queue->nodes[queue->front];
-    queue->front = (queue->front + 1) % queue->capacity;
-    return node;
+    ac_release_image(ac);
+    if (!ac->nodes) {
+        // Trie was released by ac_compile or ac_relocate_image, or never built by ac_load
+        ac->nodes = malloc(AC_DEFAULT_NODE_CAPACITY * sizeof(ac_node_t));
+        if (!ac->nodes) {
+            ac->node_count = 0;
+            ac->is_compiled = false;
+            return;
+        }
+        ac->node_capacity = AC_DEFAULT_NODE_CAPACITY;
+    }
+    memset(ac->nodes, 0, ac->node_capacity * sizeof(ac_node_t));
+    ac->node_count = 1;  // Root node
+    ac->free_list = AC_ROOT;
+    ac->free_count = 0;
+    ac->trie_pattern_count = 0;
+    ac->html_contexts = false;
+    ac->is_compiled = false;
 }
-
-static bool ac_queue_empty(const ac_queue_t *queue) {
-    return queue && (queue->front == queue->rear);
-}
\ No newline at end of file
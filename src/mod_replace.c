@@ -37,7 +37,11 @@
 
 #define MOD_REPLACE_VERSION "1.2.0"
 
-#ifndef TEST_BUILD
+/*
+ * TEST_BUILD compiles the module into test programs (test/test_module.c):
+ * httpd's headers still provide its types, but the hooks and the module
+ * record are left out and nothing is logged on the request path.
+ */
 #include "httpd.h"
 #include "http_config.h"
 #include "http_request.h"
@@ -45,35 +49,419 @@
 #include "http_log.h"
 #include "ap_config.h"
 #include "util_filter.h"
-#endif
+#include "http_core.h"
+#include "ap_expr.h"
 
 #include "apr_strings.h"
 #include "apr_buckets.h"
 #include "apr_hash.h"
 #include "apr_time.h"
+#include "apr_file_io.h"
+#include "apr_thread_mutex.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_cond.h"
+#include "apr_optional.h"
+#include "apr_base64.h"
+#include "apr_lib.h"
+#include "apr_sha1.h"
 #include "../inc/aho_corasick.h"
 
-#ifndef TEST_BUILD
-module AP_MODULE_DECLARE_DATA replace_module;
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
 #endif
 
+module AP_MODULE_DECLARE_DATA replace_module;
+
+typedef struct replace_live replace_live;
+
+/*
+ * Where the rules of a config come from, in declaration order (inherited
+ * first). Hot reload rebuilds a rule set by replaying its sources.
+ */
+typedef struct {
+    const char *file;        // ReplaceRuleFile path, read again on reload
+    apr_hash_t *rules;       // Otherwise rules fixed at startup
+    int inline_rules;        // rules collects consecutive ReplaceRule directives
+} replace_rule_source;
+
 typedef struct {
     apr_hash_t *replacements;
     ac_automaton_t *automaton;
     int enabled;
     int automaton_compiled;
     apr_pool_t *pool;  // Pool for automaton cleanup
+    apr_uint64_t rules_fingerprint;  // Sum of rule_fingerprint over the rules, the registry lookup key
+    int dynamic_rules;               // Number of rules whose replacement references a variable
+    int nonce_rules;                 // Number of rules whose replacement references ${CSP_NONCE}
+    const char *cache_dir;           // ReplaceCacheDir (NULL when the output cache is disabled)
+    const char *rules_digest;        // Output cache key, see rules_digest (NULL if nothing is cached)
+    int shared;                      // Lives as long as the configuration (read at startup or memoized)
+    apr_array_header_t *sources;     // replace_rule_source, see above
+    int has_rule_files;              // Some source is a ReplaceRuleFile
+    replace_live *live;              // Reloadable rule set (ReplaceReloadInterval), NULL otherwise
+    const int *scopes;               // Scopes in the scoped automaton, most specific first (NULL if unscoped)
+    int scope_count;
+    int nocase;                      // ReplaceCaseInsensitive: 1 on, 0 off, -1 inherited
+    apr_off_t scan_limit;            // ReplaceScanLimit bytes: 0 for the whole body, -1 inherited
+    const char *scan_terminator;     // ReplaceScanLimit terminator, NULL for none
 } replace_config;
 
+/* Automata of case-insensitive rule sets fold ASCII case; see ac_set_case_insensitive */
+#define config_nocase(config) ((config)->nocase == 1)
+
+/* Only the start of the body is rewritten; see ReplaceScanLimit */
+#define config_scan_limited(config) ((config)->scan_limit > 0 || (config)->scan_terminator)
+
+typedef enum {
+    REPLACE_CACHE_NONE = 0,  // Response is not cacheable
+    REPLACE_CACHE_HIT,       // Serve the cached body, drop upstream data
+    REPLACE_CACHE_STORE      // Rewrite as usual and store the result
+} replace_cache_state;
+
 typedef struct {
     apr_bucket_brigade *bb;
     apr_pool_t *pool;
+    replace_config *cfg;     // Config with the rule set this response started with
+    replace_cache_state cache_state;
+    const char *cache_path;  // Cache entry for this response (HIT/STORE only)
+    apr_file_t *cache_file;  // Open cache entry (HIT only)
+    apr_off_t cache_body;    // Where the rewritten body starts in cache_file
+    apr_hash_t *variables;   // Variables resolved for this response, see resolve_variable
+    apr_off_t scanned;       // Body bytes collected so far (ReplaceScanLimit only)
+    apr_off_t scan_end;      // Length of the scanned prefix once found, 0 before
+    char *carry;             // Last bytes collected, for terminators split across buckets
+    apr_size_t carry_len;
+    char *joined;            // Carry followed by the head of the next bucket
+    int passthrough;         // Scan limit reached: the rest of the body goes by untouched
 } replace_ctx;
 
+/*
+ * Replacement values are compiled once, when the automaton is built, into
+ * literal and variable segments, so a match only looks variables up and
+ * copies bytes. Every "${VAR}" or "%{VAR}" reference, wherever it appears,
+ * becomes a variable segment; the text around references becomes literal
+ * segments. Well-known names are bound to a provider that reads the value
+ * straight from the request; other names are looked up in subprocess_env,
+ * then in the server's environment as it was when the value was compiled.
+ * A value of the form "expr=<expression>" is one expression segment, parsed
+ * once here and evaluated at most once per response. In ReplaceRegex values,
+ * "$0" to "$9" are group segments, copied from the regex match.
+ */
+typedef enum {
+    REPLACE_SEGMENT_LITERAL,
+    REPLACE_SEGMENT_VARIABLE,
+    REPLACE_SEGMENT_EXPR,
+    REPLACE_SEGMENT_GROUP
+} replace_segment_type;
+
+#define REPLACE_EXPR_PREFIX "expr="
+#define REPLACE_EXPR_PREFIX_LEN 5
+
+typedef struct {
+    replace_segment_type type;
+    const char *text;                  // Literal bytes, NUL-terminated variable name, or the value of an expression
+    apr_size_t len;
+    const char *reference;             // "${VAR}" text, the result when the variable is unset
+    apr_size_t reference_len;
+    int provider;                      // Index into replace_providers, or REPLACE_NO_PROVIDER
+    const char *environment;           // getenv value at compile time, for other names
+    ap_expr_info_t *expr;              // Parsed expression
+    int group;                         // Regex group number
+} replace_segment;
+
+/* Per-rule matching options of ReplaceRule */
+typedef struct {
+    ac_boundary_t left, right;
+    unsigned contexts;                 // AC_CONTEXT_* mask, 0 for any
+} replace_rule_options;
+
+typedef struct replacement_template replacement_template_t;
+struct replacement_template {
+    const char *replacement_template;  // Source value
+    replace_segment *segments;
+    int segment_count;
+    apr_size_t literal_len;            // Total length of the literal segments
+    ap_regex_t *regex;                 // ReplaceRegex rule confirmed around the literal, NULL otherwise
+    const char *regex_source;          // Expression, orders regexes sharing a literal
+    replace_rule_options options;      // Of a literal rule sharing a regex's literal
+    replacement_template_t *next;      // Next rule for the same literal, see build_automaton
+};
+
+/*
+ * ReplaceRegex rules live in the rule table next to literal rules, keyed by
+ * REPLACE_REGEX_KEY followed by the expression, a prefix no search string
+ * written in a configuration contains. Each regex is fed to the automaton
+ * as the longest literal every match must contain, and only runs in a
+ * window of REPLACE_REGEX_WINDOW bytes on either side of a hit of that
+ * literal, so bodies without hits cost a literal scan.
+ */
+#define REPLACE_REGEX_KEY "\001"
+#define REPLACE_REGEX_WINDOW 256
+#define REPLACE_REGEX_MIN_LITERAL 3
+#define is_regex_rule(search) ((search)[0] == REPLACE_REGEX_KEY[0])
+
+/* A rule table value: the replacement and the options it was defined with */
+typedef struct {
+    const char *replacement;
+    replace_rule_options options;
+} replace_rule;
+
+#define has_rule_options(rule) \
+    ((rule)->options.left != AC_BOUNDARY_NONE || (rule)->options.right != AC_BOUNDARY_NONE || \
+     (rule)->options.contexts != 0)
+
+static replace_rule *make_rule(apr_pool_t *pool, const char *replacement,
+                               const replace_rule_options *options)
+{
+    replace_rule *rule = apr_pcalloc(pool, sizeof(*rule));
+    rule->replacement = replacement;
+    if (options) {
+        rule->options = *options;
+    } else {
+        rule->options.left = rule->options.right = AC_BOUNDARY_NONE;
+    }
+    return rule;
+}
+
+static int same_rule(const replace_rule *a, const replace_rule *b)
+{
+    return strcmp(a->replacement, b->replacement) == 0 &&
+           a->options.left == b->options.left && a->options.right == b->options.right &&
+           a->options.contexts == b->options.contexts;
+}
+
+/* A variable resolved once per response; later occurrences are copied from here */
+typedef struct {
+    const char *value;       // NULL if the variable is unset
+    apr_size_t len;
+} replace_variable_value;
+
+/*
+ * Context of expand_replacement_callback. Templates belong to automata shared
+ * by all requests and threads, so everything expansion allocates comes from
+ * pool, which lives for one response, never from configuration memory.
+ */
+typedef struct {
+    apr_pool_t *pool;
+    request_rec *r;
+    replace_config *cfg;
+    apr_hash_t *variables;   // name -> replace_variable_value
+    const char *subject;     // Text groups[] refers to, while a regex match is expanded
+    ap_regmatch_t groups[AP_MAX_REG_MATCH];
+} replace_expand_ctx;
+
+/*
+ * Configs that own rules, collected while the configuration is read and
+ * compiled once in post_config, before any child serves traffic. NULL outside
+ * the configuration phase: configs merged at request time are private to the
+ * request and get compiled on the spot, so the request path never compiles
+ * an automaton shared between threads.
+ */
+static apr_array_header_t *pending_configs = NULL;
+
+/*
+ * Merge cache. httpd merges <Directory>/<Location>/.htaccess configs for every
+ * request, so merged configs are memoized by (parent, child) identity when
+ * both live as long as the configuration.
+ *
+ * The same lock guards the automaton registry: every compiled automaton is
+ * interned by rule-set fingerprint (confirmed rule by rule), so server,
+ * directory and merged configs and reloaded generations with the same
+ * effective rules share one read-only automaton. Startup cost and memory
+ * then follow the number of distinct rule sets, not of config sections.
+ * Entries built for reloaded generations are refcounted and freed with
+ * their last user; the others live as long as the configuration.
+ *
+ * Both tables are bounded at request time; past the limit merges fall back
+ * to private, request-lifetime automata.
+ */
+#define REPLACE_MERGE_CACHE_MAX 1024
+
+#define REPLACE_MERGE_SLOTS (2 * REPLACE_MERGE_CACHE_MAX)  // A power of two, never more than half full
+
+typedef struct {
+    const void *parent;
+    const void *child;
+} replace_merge_key;
+
+typedef struct {
+    replace_merge_key key;
+    replace_config *merged;
+} replace_merge_entry;
+
+typedef struct replace_shared_automaton replace_shared_automaton;
+struct replace_shared_automaton {
+    apr_uint64_t fingerprint;
+    apr_hash_t *replacements;        // Rules the automaton was built from
+    ac_automaton_t *automaton;
+    apr_pool_t *pool;                // Owns a refcounted entry; NULL if it lives with the configuration
+    apr_uint32_t refs;               // Rule sets using it, under the cache lock
+    replace_shared_automaton *next;  // Next entry with the same fingerprint
+};
+
+static struct {
+    apr_pool_t *pool;        // pconf while reading the configuration, a child pool afterwards
+    replace_merge_entry *volatile merges[REPLACE_MERGE_SLOTS];  // Open addressing, read without the lock
+    apr_hash_t *automata;    // fingerprint -> replace_shared_automaton (the registry)
+    int merge_count;
+    int automaton_count;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;  // Created in child_init, nested
+#endif
+} merge_cache;
+
+/*
+ * Scoped automaton. Nested configs repeat the same global rules with a few
+ * additions each, so instead of one automaton per rule set, post_config
+ * builds a single automaton over the rules of every rule set fixed at
+ * startup, and gives each such rule set a scope. A pattern carries its
+ * replacements, each tagged with the bitmask of the scopes using it, and a
+ * match only applies if the request's config has a scope in that mask.
+ *
+ * A config merged at request time from scoped configs needs no automaton of
+ * its own: its scopes are the child's followed by the parent's, and the first
+ * of them with a replacement for the pattern wins, exactly as the merged rule
+ * table overlays the child's rules on the parent's. Rule sets that can change
+ * (ReplaceReloadInterval), precompiled images and .htaccess rules keep
+ * automata of their own.
+ */
+typedef struct {
+    replacement_template_t *tmpl;
+    apr_uint64_t *mask;              // Scopes using this replacement, one bit each
+} replace_scoped_variant;
+
+typedef struct {
+    int count;
+    replace_scoped_variant *variants;  // Distinct replacements of one pattern
+} replace_scoped_rule;
+
+static struct {
+    ac_automaton_t *automaton;       // NULL until post_config, or if fewer than two rule sets qualify
+    int scope_count;
+    apr_interval_time_t build_time;
+} scoped;
+
+/*
+ * Hot reload. With ReplaceReloadInterval, each rule set read at startup or
+ * memoized by the merge cache that uses a ReplaceRuleFile is published as a
+ * refcounted generation. A watcher thread per child checks the files' mtime
+ * and size every interval, builds and compiles a new generation off the
+ * request path and swaps it in. Requests take a reference to the current
+ * generation when they start, so in-flight responses finish with the rules
+ * they began with; the last reference frees the old generation.
+ *
+ * Taking a reference (load pointer, increment count) must not race with the
+ * swap dropping the last one, so it happens under reload.lock; the critical
+ * section is a pointer load and an atomic increment.
+ */
+typedef struct replace_generation replace_generation;
+struct replace_generation {
+    apr_pool_t *pool;                  // Owns the rules; NULL for the startup rules
+    apr_hash_t *replacements;
+    ac_automaton_t *automaton;
+    replace_shared_automaton *shared;  // Registry entry holding automaton, released with the generation
+    apr_uint64_t rules_fingerprint;
+    const char *rules_digest;
+    int dynamic_rules;
+    int nonce_rules;
+    replace_generation *borrowed[2];   // Generations whose rule strings this one points into
+    volatile apr_uint32_t refs;        // Requests using it, plus one while current
+};
+
+struct replace_live {
+    replace_config *config;            // Rule sources to rebuild from
+    replace_generation *volatile current;
+};
+
+/*
+ * A rule file is reloaded once its size and mtime have stayed the same over
+ * two polls, so a file still being written is not picked up, and its stat
+ * is only recorded once every rule set using it has been rebuilt from it:
+ * a reload that fails is retried at the next poll.
+ */
+typedef struct {
+    const char *path;
+    apr_time_t mtime;                  // Of the rules in use
+    apr_off_t size;
+    apr_time_t seen_mtime;             // Of the last poll, when it differs from the rules in use
+    apr_off_t seen_size;
+    int seen;
+    int failed;                        // A rule set using it could not be rebuilt this round
+} replace_watched_file;
+
+static struct {
+    apr_interval_time_t interval;      // ReplaceReloadInterval, 0 when disabled
+    apr_pool_t *pool;                  // pconf while reading the configuration, a child pool afterwards
+    apr_array_header_t *lives;         // replace_live *
+    apr_hash_t *files;                 // path -> replace_watched_file
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;          // Created in child_init
+    apr_thread_cond_t *wakeup;         // Signalled to stop the watcher
+    apr_thread_t *watcher;
+    int stopping;
+#endif
+} reload;
+
+/*
+ * Random bytes for CSP nonces come from a per-thread buffer refilled from
+ * the system CSPRNG, so a nonce costs one system call per few hundred
+ * responses. Buffers are only filled in child processes, never before a
+ * fork, and consumed bytes are wiped.
+ */
+#define REPLACE_NONCE_BYTES 18         // 144 bits, 24 base64 characters without padding
+#define REPLACE_RANDOM_BUFFER_SIZE (REPLACE_NONCE_BYTES * 224)
+#define REPLACE_NONCE_NOTE "CSP_NONCE"
+
 typedef struct {
-    const char *replacement_template;  // Template with variables like "${VAR}" or "%{VAR}"
-    apr_pool_t *pool;                  // Pool for allocations
-} replacement_template_t;
+    unsigned char bytes[REPLACE_RANDOM_BUFFER_SIZE];
+    apr_size_t used;
+} replace_random_buffer;
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *random_key = NULL;  // Created in child_init
+#else
+static replace_random_buffer *random_buffer = NULL;
+#endif
+
+static void merge_cache_lock(void)
+{
+#if APR_HAS_THREADS
+    if (merge_cache.lock) {
+        apr_thread_mutex_lock(merge_cache.lock);
+    }
+#endif
+}
+
+static void merge_cache_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (merge_cache.lock) {
+        apr_thread_mutex_unlock(merge_cache.lock);
+    }
+#endif
+}
+
+static void reload_lock(void)
+{
+#if APR_HAS_THREADS
+    if (reload.lock) {
+        apr_thread_mutex_lock(reload.lock);
+    }
+#endif
+}
+
+static void reload_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (reload.lock) {
+        apr_thread_mutex_unlock(reload.lock);
+    }
+#endif
+}
 
 static apr_status_t cleanup_automaton(void *data)
 {
@@ -84,93 +472,1822 @@ static apr_status_t cleanup_automaton(void *data)
     return APR_SUCCESS;
 }
 
-static void *create_replace_config(apr_pool_t *pool, char *path)
+/*
+ * Per-rule FNV-1a hash. Rule hashes are summed into the rule-set fingerprint,
+ * so the result does not depend on hash iteration order and a redefined rule
+ * can be swapped out without rescanning the whole set. Sums collide easily,
+ * so the fingerprint only finds candidates that are then compared rule by
+ * rule; the output cache, which trusts its key alone, uses rules_digest.
+ */
+static apr_uint64_t rule_fingerprint(const char *search, const replace_rule *rule)
 {
-    replace_config *cfg = apr_pcalloc(pool, sizeof(replace_config));
-    cfg->replacements = apr_hash_make(pool);
-    cfg->automaton = ac_create(0);
-    cfg->enabled = 0;
-    cfg->automaton_compiled = 0;
-    cfg->pool = pool;
-    
-    // Register cleanup for automaton
-    if (cfg->automaton) {
-        apr_pool_cleanup_register(pool, cfg->automaton, cleanup_automaton, apr_pool_cleanup_null);
+    apr_uint64_t h = APR_UINT64_C(14695981039346656037);
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)search; *p; p++) {
+        h = (h ^ *p) * APR_UINT64_C(1099511628211);
     }
-    
-    return cfg;
+    h = (h ^ 0xff) * APR_UINT64_C(1099511628211);
+    for (p = (const unsigned char *)rule->replacement; *p; p++) {
+        h = (h ^ *p) * APR_UINT64_C(1099511628211);
+    }
+    h = (h ^ (unsigned)rule->options.left) * APR_UINT64_C(1099511628211);
+    h = (h ^ (unsigned)rule->options.right) * APR_UINT64_C(1099511628211);
+    h = (h ^ rule->options.contexts) * APR_UINT64_C(1099511628211);
+    return h;
 }
 
-static void *merge_replace_config(apr_pool_t *pool, void *parent_conf, void *new_conf)
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/*
+ * SHA-1 of a rule set and case mode in hex, the key of its ReplaceCacheDir
+ * entries. Rules are hashed sorted by search string, each string with its
+ * terminating NUL and followed by the rule's options, so the digest is
+ * independent of hash order and two rule sets only share entries if their
+ * rules are the same.
+ */
+static const char *rules_digest(apr_pool_t *pool, apr_hash_t *replacements, int nocase)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char **searches = apr_palloc(pool, (apr_hash_count(replacements) + 1) * sizeof(const char *));
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char *result = apr_palloc(pool, 2 * APR_SHA1_DIGESTSIZE + 1);
+    apr_sha1_ctx_t sha1;
+    apr_hash_index_t *hi;
+    int i, count = 0;
+
+    for (hi = apr_hash_first(pool, replacements); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, (const void **)&searches[count++], NULL, NULL);
+    }
+    qsort(searches, count, sizeof(const char *), compare_strings);
+
+    apr_sha1_init(&sha1);
+    apr_sha1_update(&sha1, nocase ? "i" : "s", 1);
+    for (i = 0; i < count; i++) {
+        const replace_rule *rule = apr_hash_get(replacements, searches[i], APR_HASH_KEY_STRING);
+        char options[16];
+        int options_len = apr_snprintf(options, sizeof(options), "%d %d %x", (int)rule->options.left,
+                                       (int)rule->options.right, rule->options.contexts);
+        apr_sha1_update(&sha1, searches[i], (unsigned int)strlen(searches[i]) + 1);
+        apr_sha1_update(&sha1, rule->replacement, (unsigned int)strlen(rule->replacement) + 1);
+        apr_sha1_update(&sha1, options, (unsigned int)options_len + 1);
+    }
+    apr_sha1_final(digest, &sha1);
+
+    for (i = 0; i < APR_SHA1_DIGESTSIZE; i++) {
+        result[2 * i] = hex[digest[i] >> 4];
+        result[2 * i + 1] = hex[digest[i] & 0xf];
+    }
+    result[2 * APR_SHA1_DIGESTSIZE] = '\0';
+    return result;
+}
+
+/* Key the output cache of a config whose responses can be cached */
+static void digest_config_rules(apr_pool_t *pool, replace_config *config)
+{
+    if (config->cache_dir && config->dynamic_rules == 0 && apr_hash_count(config->replacements) > 0) {
+        config->rules_digest = rules_digest(pool, config->replacements, config_nocase(config));
+    }
+}
+
+/*
+ * Parse the "${VAR}" or "%{VAR}" reference starting at p. Returns the length
+ * of the reference, or 0 if p does not start one.
+ */
+static apr_size_t parse_variable(const char *p, const char **name, apr_size_t *name_len)
+{
+    const char *var_end;
+
+    if ((p[0] != '$' && p[0] != '%') || p[1] != '{' || p[2] == '\0') {
+        return 0;
+    }
+    var_end = strchr(p + 2, '}');
+    if (!var_end || var_end == p + 2) {
+        return 0;
+    }
+    *name = p + 2;
+    *name_len = (apr_size_t)(var_end - p - 2);
+    return (apr_size_t)(var_end - p + 1);
+}
+
+// Does the value depend on the request?
+static int replacement_has_variable(const char *replace_val)
+{
+    const char *name;
+    apr_size_t name_len;
+    const char *p;
+
+    if (replace_val && strncmp(replace_val, REPLACE_EXPR_PREFIX, REPLACE_EXPR_PREFIX_LEN) == 0) {
+        return 1;
+    }
+    for (p = replace_val; p && *p; p++) {
+        if (parse_variable(p, &name, &name_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Does the value reference the CSP nonce? Headers of its responses may need it early
+static int replacement_has_nonce(const char *replace_val)
+{
+    const char *name;
+    apr_size_t name_len;
+    const char *p;
+
+    if (replace_val && strncmp(replace_val, REPLACE_EXPR_PREFIX, REPLACE_EXPR_PREFIX_LEN) == 0) {
+        return 0;
+    }
+    for (p = replace_val; p && *p; p++) {
+        if (parse_variable(p, &name, &name_len) &&
+            name_len == sizeof("CSP_NONCE") - 1 && memcmp(name, "CSP_NONCE", name_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* mod_ssl's test for HTTPS connections, if mod_ssl is loaded */
+APR_DECLARE_OPTIONAL_FN(int, ssl_is_https, (conn_rec *));
+static APR_OPTIONAL_FN_TYPE(ssl_is_https) *replace_is_https = NULL;
+
+static const char *provide_server_name(request_rec *r)
+{
+    return ap_get_server_name(r);
+}
+
+static const char *provide_server_port(request_rec *r)
+{
+    return apr_psprintf(r->pool, "%u", ap_get_server_port(r));
+}
+
+static const char *provide_remote_user(request_rec *r)
+{
+    return r->user;
+}
+
+static const char *provide_remote_addr(request_rec *r)
+{
+    return r->useragent_ip;
+}
+
+static const char *provide_request_uri(request_rec *r)
+{
+    return r->uri;
+}
+
+static const char *provide_request_method(request_rec *r)
+{
+    return r->method;
+}
+
+static const char *provide_query_string(request_rec *r)
+{
+    return r->args ? r->args : "";
+}
+
+static const char *provide_request_scheme(request_rec *r)
+{
+    return ap_http_scheme(r);
+}
+
+static const char *provide_server_protocol(request_rec *r)
+{
+    return r->protocol;
+}
+
+static const char *provide_http_host(request_rec *r)
+{
+    return apr_table_get(r->headers_in, "Host");
+}
+
+static const char *provide_https(request_rec *r)
+{
+    return replace_is_https && replace_is_https(r->connection) ? "on" : "off";
+}
+
+static const char *provide_document_root(request_rec *r)
+{
+    return ap_document_root(r);
+}
+
+static const char *provide_server_software(request_rec *r)
+{
+    (void)r;
+    return ap_get_server_banner();
+}
+
+static apr_status_t random_bytes(unsigned char *out, apr_size_t len)
+{
+    replace_random_buffer *buffer = NULL;
+    apr_status_t rv;
+
+#if APR_HAS_THREADS
+    if (!random_key) {
+        return apr_generate_random_bytes(out, len);
+    }
+    apr_threadkey_private_get((void **)&buffer, random_key);
+#else
+    buffer = random_buffer;
+#endif
+    if (!buffer) {
+        buffer = malloc(sizeof(replace_random_buffer));
+        if (!buffer) {
+            return APR_ENOMEM;
+        }
+        buffer->used = REPLACE_RANDOM_BUFFER_SIZE;
+#if APR_HAS_THREADS
+        apr_threadkey_private_set(buffer, random_key);
+#else
+        random_buffer = buffer;
+#endif
+    }
+
+    if (buffer->used + len > REPLACE_RANDOM_BUFFER_SIZE) {
+        rv = apr_generate_random_bytes(buffer->bytes, REPLACE_RANDOM_BUFFER_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        buffer->used = 0;
+    }
+    memcpy(out, buffer->bytes + buffer->used, len);
+    memset(buffer->bytes + buffer->used, 0, len);
+    buffer->used += len;
+    return APR_SUCCESS;
+}
+
+/*
+ * The response's CSP nonce, created on first use and kept in the notes of
+ * the main request, where "Header ... expr=%{note:CSP_NONCE}" finds it.
+ * Subrequests share the nonce of their main request.
+ */
+static const char *provide_csp_nonce(request_rec *r)
+{
+    request_rec *main_req = r;
+    unsigned char raw[REPLACE_NONCE_BYTES];
+    const char *nonce;
+    char *encoded;
+
+    while (main_req->main) {
+        main_req = main_req->main;
+    }
+    nonce = apr_table_get(main_req->notes, REPLACE_NONCE_NOTE);
+    if (nonce) {
+        return nonce;
+    }
+
+    if (random_bytes(raw, sizeof(raw)) != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "mod_replace: cannot generate a CSP nonce");
+        return NULL;
+    }
+    encoded = apr_palloc(main_req->pool, apr_base64_encode_len(sizeof(raw)));
+    apr_base64_encode_binary(encoded, raw, sizeof(raw));
+    memset(raw, 0, sizeof(raw));
+    apr_table_setn(main_req->notes, REPLACE_NONCE_NOTE, encoded);
+    return encoded;
+}
+
+/*
+ * Variables read from request_rec and conn_rec. A provider returns NULL when
+ * the request has no value (REMOTE_USER without authentication), which
+ * leaves the reference in the output like any unset variable.
+ */
+typedef struct {
+    const char *name;
+    const char *(*value)(request_rec *r);
+} replace_provider;
+
+static const replace_provider replace_providers[] = {
+    { "SERVER_NAME",     provide_server_name },
+    { "SERVER_PORT",     provide_server_port },
+    { "REMOTE_USER",     provide_remote_user },
+    { "REMOTE_ADDR",     provide_remote_addr },
+    { "REQUEST_URI",     provide_request_uri },
+    { "REQUEST_METHOD",  provide_request_method },
+    { "QUERY_STRING",    provide_query_string },
+    { "REQUEST_SCHEME",  provide_request_scheme },
+    { "SERVER_PROTOCOL", provide_server_protocol },
+    { "HTTP_HOST",       provide_http_host },
+    { "HTTPS",           provide_https },
+    { "DOCUMENT_ROOT",   provide_document_root },
+    { "SERVER_SOFTWARE", provide_server_software },
+    { "CSP_NONCE",       provide_csp_nonce }
+};
+
+#define REPLACE_NO_PROVIDER -1
+
+static int find_provider(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(replace_providers) / sizeof(replace_providers[0])); i++) {
+        if (strcmp(replace_providers[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return REPLACE_NO_PROVIDER;
+}
+
+/* Parse the expression of an "expr=" value; NULL if it is not valid, with the reason in *error */
+static ap_expr_info_t *parse_replacement_expr(apr_pool_t *pool, const char *replace_val,
+                                              const char **error)
+{
+    ap_expr_info_t *info = apr_pcalloc(pool, sizeof(ap_expr_info_t));
+    const char *err;
+
+    info->filename = "ReplaceRule";
+    info->flags = AP_EXPR_FLAG_STRING_RESULT;
+    info->module_index = replace_module.module_index;
+    err = ap_expr_parse(pool, pool, info, replace_val + REPLACE_EXPR_PREFIX_LEN, NULL);
+    if (error) {
+        *error = err;
+    }
+    return err ? NULL : info;
+}
+
+/* Why an "expr=" value read from a file or image cannot be used; NULL if it can, or is no expression */
+static const char *replacement_expr_error(apr_pool_t *pool, const char *replace_val)
+{
+    const char *error = NULL;
+
+    if (strncmp(replace_val, REPLACE_EXPR_PREFIX, REPLACE_EXPR_PREFIX_LEN) != 0 ||
+        parse_replacement_expr(pool, replace_val, &error)) {
+        return NULL;
+    }
+    return apr_psprintf(pool, "cannot parse expression '%s': %s",
+                        replace_val + REPLACE_EXPR_PREFIX_LEN, error);
+}
+
+/*
+ * Split a value into segments: one pass counts them, a second fills them.
+ * Adjacent literal text is kept as one segment, so "https://${HOST}/x" has
+ * three segments and a value without references has exactly one.
+ */
+static replacement_template_t *compile_template(apr_pool_t *pool, const char *replace_val, int groups)
+{
+    replacement_template_t *tmpl = apr_pcalloc(pool, sizeof(replacement_template_t));
+    const char *name, *p, *literal;
+    apr_size_t name_len, ref_len;
+    int count = 0, pass, group;
+
+    tmpl->replacement_template = replace_val;
+
+    // Every rule source rejects expressions that do not parse when it is
+    // read (ReplaceRule, rule files, images), so this parse succeeds
+    if (strncmp(replace_val, REPLACE_EXPR_PREFIX, REPLACE_EXPR_PREFIX_LEN) == 0) {
+        ap_expr_info_t *expr = parse_replacement_expr(pool, replace_val, NULL);
+        if (expr) {
+            replace_segment *segment = apr_pcalloc(pool, sizeof(replace_segment));
+
+            segment->type = REPLACE_SEGMENT_EXPR;
+            segment->text = replace_val;
+            segment->len = strlen(replace_val);
+            segment->reference = replace_val;
+            segment->reference_len = segment->len;
+            segment->provider = REPLACE_NO_PROVIDER;
+            segment->expr = expr;
+            tmpl->segments = segment;
+            tmpl->segment_count = 1;
+            return tmpl;
+        }
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        replace_segment *segment = tmpl->segments;
+
+        literal = p = replace_val;
+        while (1) {
+            ref_len = *p ? parse_variable(p, &name, &name_len) : 0;
+            group = -1;
+            if (!ref_len && groups && p[0] == '$' && apr_isdigit(p[1])) {
+                group = p[1] - '0';
+                ref_len = 2;
+            }
+            if (!ref_len && *p) {
+                p++;
+                continue;
+            }
+            if (p > literal || (!*p && p == replace_val)) {
+                if (segment) {
+                    segment->type = REPLACE_SEGMENT_LITERAL;
+                    segment->text = literal;
+                    segment->len = (apr_size_t)(p - literal);
+                    tmpl->literal_len += segment->len;
+                    segment++;
+                }
+                count++;
+            }
+            if (!*p) {
+                break;
+            }
+            if (segment && group >= 0) {
+                segment->type = REPLACE_SEGMENT_GROUP;
+                segment->text = p;
+                segment->len = ref_len;
+                segment->reference = p;
+                segment->reference_len = ref_len;
+                segment->provider = REPLACE_NO_PROVIDER;
+                segment->group = group;
+                segment++;
+            } else if (segment) {
+                segment->type = REPLACE_SEGMENT_VARIABLE;
+                segment->text = apr_pstrmemdup(pool, name, name_len);
+                segment->len = name_len;
+                segment->reference = p;
+                segment->reference_len = ref_len;
+                segment->provider = find_provider(segment->text);
+                if (segment->provider == REPLACE_NO_PROVIDER) {
+                    const char *value = getenv(segment->text);
+                    segment->environment = value ? apr_pstrdup(pool, value) : NULL;
+                }
+                segment++;
+            }
+            count++;
+            literal = p += ref_len;
+        }
+
+        if (pass == 0) {
+            tmpl->segments = apr_pcalloc(pool, count * sizeof(replace_segment));
+            tmpl->segment_count = count;
+        }
+    }
+    return tmpl;
+}
+
+/* Skip a [...] class starting at p; returns the byte after it, NULL if unterminated */
+static const char *skip_regex_class(const char *p)
+{
+    p++;
+    if (*p == '^') {
+        p++;
+    }
+    if (*p == ']') {
+        p++;
+    }
+    while (*p && *p != ']') {
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        p++;
+    }
+    return *p ? p + 1 : NULL;
+}
+
+/* Skip a (...) group starting at p; returns the byte after it, NULL if unbalanced */
+static const char *skip_regex_group(const char *p)
+{
+    int depth = 0;
+
+    while (*p) {
+        if (*p == '\\' && p[1]) {
+            p += 2;
+            continue;
+        }
+        if (*p == '[') {
+            p = skip_regex_class(p);
+            if (!p) {
+                return NULL;
+            }
+            continue;
+        }
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/*
+ * Parse a quantifier at p ("?", "*", "+", "{n}", "{n,}", "{n,m}" and their
+ * lazy or possessive forms). Returns its length, 0 if there is none; *min
+ * is the least number of repetitions.
+ */
+static apr_size_t regex_quantifier(const char *p, int *min)
+{
+    const char *q = p;
+
+    if (*q == '?' || *q == '*') {
+        *min = 0;
+        q++;
+    } else if (*q == '+') {
+        *min = 1;
+        q++;
+    } else if (*q == '{' && apr_isdigit(q[1])) {
+        *min = atoi(q + 1);
+        q++;
+        while (apr_isdigit(*q) || *q == ',') {
+            q++;
+        }
+        if (*q != '}') {
+            return 0;  // Not a quantifier: "{" is a literal
+        }
+        q++;
+    } else {
+        return 0;
+    }
+    if (*q == '?' || *q == '+') {
+        q++;
+    }
+    return (apr_size_t)(q - p);
+}
+
+/* Why regex_literal gives up on an escape outside a class */
+static const char *unsupported_escape(apr_pool_t *pool, char c)
+{
+    if (apr_isdigit(c) && c != '0') {
+        return "backreferences (\\1 to \\9) are not supported";
+    }
+    switch (c) {
+    case 'g':
+    case 'k':
+        return "backreferences (\\g, \\k) are not supported";
+    case 'x':
+        return "\\x escapes are not supported outside a class; use [\\x..]";
+    case 'Q':
+    case 'E':
+        return "\\Q...\\E quoting is not supported; escape the characters instead";
+    case 'p':
+    case 'P':
+        return "\\p and \\P properties are not supported";
+    default:
+        return apr_psprintf(pool, "the \\%c escape is not supported outside a class", c);
+    }
+}
+
+/*
+ * The longest run of bytes every match of the regex contains, so the
+ * automaton can find the places worth running it. Conservative: groups,
+ * classes and escapes other than escaped punctuation end a run, optional
+ * characters are dropped, and a top-level alternation or an inline flag
+ * that changes how literals match gives no literal at all. Escapes whose
+ * width cannot be told without parsing them (\x41, \Q...\E, \p{L},
+ * backreferences) give none either, with *unsupported saying which.
+ */
+static const char *regex_literal(apr_pool_t *pool, const char *regex, apr_size_t *len,
+                                 const char **unsupported)
+{
+    char *run = apr_palloc(pool, strlen(regex) + 1);
+    const char *best = NULL;
+    apr_size_t run_len = 0, best_len = 0;
+    const char *p = regex;
+
+    while (1) {
+        int literal = -1, min;
+        apr_size_t quantifier;
+
+        if (*p == '\\' && p[1]) {
+            if (apr_isalnum(p[1])) {
+                // Character types and assertions are one byte wide or none
+                if (!strchr("dDwWsSbBAzZhHvVRN", p[1])) {
+                    *unsupported = unsupported_escape(pool, p[1]);
+                    return NULL;
+                }
+            } else {
+                literal = (unsigned char)p[1];
+            }
+            p += 2;
+        } else if (*p == '(') {
+            if (p[1] == '?' && p[2] != ':' && p[2] != '=' && p[2] != '!' && p[2] != '<' &&
+                p[2] != '>' && p[2] != '|') {
+                *unsupported = "inline flags such as (?i) are not supported";
+                return NULL;
+            }
+            p = skip_regex_group(p);
+            if (!p) {
+                return NULL;
+            }
+        } else if (*p == '[') {
+            p = skip_regex_class(p);
+            if (!p) {
+                return NULL;
+            }
+        } else if (*p == '|') {
+            *unsupported = "a top-level | leaves no literal common to all matches";
+            return NULL;
+        } else if (*p == '.' || *p == '^' || *p == '$') {
+            p++;
+        } else if (*p) {
+            literal = (unsigned char)*p++;
+        }
+
+        quantifier = regex_quantifier(p, &min);
+        p += quantifier;
+        if (literal >= 0 && !(quantifier && min == 0)) {
+            run[run_len++] = (char)literal;
+        }
+        if (literal < 0 || quantifier) {
+            if (run_len > best_len) {
+                best = apr_pstrmemdup(pool, run, run_len);
+                best_len = run_len;
+            }
+            run_len = 0;
+        }
+        if (!*p && literal < 0 && !quantifier) {
+            break;
+        }
+    }
+    *len = best_len;
+    return best;
+}
+
+/* Compile a ReplaceRegex rule; NULL with *error set if it cannot be used */
+static replacement_template_t *compile_regex_rule(apr_pool_t *pool, const char *regex,
+                                                  const char *replace_val, int nocase,
+                                                  const char **literal, const char **error)
+{
+    replacement_template_t *tmpl;
+    ap_regex_t *compiled;
+    apr_size_t literal_len;
+    const char *unsupported = NULL;
+
+    *literal = regex_literal(pool, regex, &literal_len, &unsupported);
+    if (unsupported) {
+        *error = unsupported;
+        return NULL;
+    }
+    if (!*literal || literal_len < REPLACE_REGEX_MIN_LITERAL) {
+        *error = apr_psprintf(pool, "no literal of at least %d characters that every match "
+                              "contains", REPLACE_REGEX_MIN_LITERAL);
+        return NULL;
+    }
+    compiled = ap_pregcomp(pool, regex, nocase ? AP_REG_ICASE : 0);
+    if (!compiled) {
+        *error = "invalid regular expression";
+        return NULL;
+    }
+
+    tmpl = compile_template(pool, replace_val, 1);
+    tmpl->regex = compiled;
+    return tmpl;
+}
+
+/*
+ * Rules that share a literal, several regexes or a regex and a literal rule,
+ * become one pattern whose templates are chained: the regexes in order of
+ * their expressions, then the literal rule. The first that applies wins.
+ */
+static void chain_template(apr_pool_t *pool, apr_hash_t *chains, const char *literal,
+                           replacement_template_t *tmpl)
+{
+    replacement_template_t **link = apr_hash_get(chains, literal, APR_HASH_KEY_STRING);
+
+    if (!link) {
+        link = apr_pcalloc(pool, sizeof(replacement_template_t *));
+        apr_hash_set(chains, literal, APR_HASH_KEY_STRING, link);
+    }
+    while (*link && (*link)->regex &&
+           (!tmpl->regex || strcmp((*link)->regex_source, tmpl->regex_source) < 0)) {
+        link = &(*link)->next;
+    }
+    tmpl->next = *link;
+    *link = tmpl;
+}
+
+/*
+ * A rule the automaton refused (an empty search, or out of memory) fails
+ * the whole rule set rather than leaving it to silently skip the rule.
+ */
+static ac_automaton_t *reject_automaton(apr_pool_t *pool, ac_automaton_t *automaton,
+                                        const char *search, const char *what)
+{
+    ap_log_perror(APLOG_MARK, APLOG_ERR, 0, pool,
+                  "mod_replace: cannot %s for rule '%s'", what, search);
+    apr_pool_cleanup_run(pool, automaton, cleanup_automaton);
+    return NULL;
+}
+
+static ac_automaton_t *build_automaton(apr_pool_t *pool, apr_hash_t *replacements, int nocase)
+{
+    ac_automaton_t *automaton = ac_create(0);
+    apr_hash_t *chains = apr_hash_make(pool);
+    apr_hash_index_t *hi;
+
+    if (!automaton) {
+        return NULL;
+    }
+    apr_pool_cleanup_register(pool, automaton, cleanup_automaton, apr_pool_cleanup_null);
+    ac_set_case_insensitive(automaton, nocase);
+
+    // Regex rules are found through their literals; ReplaceRegex rejected
+    // rules without one, so a failure here means a broken rule file
+    for (hi = apr_hash_first(pool, replacements); hi; hi = apr_hash_next(hi)) {
+        const char *search = NULL;
+        replace_rule *rule = NULL;
+        const char *literal, *error;
+        replacement_template_t *tmpl;
+        apr_hash_this(hi, (const void **)&search, NULL, (void **)&rule);
+
+        if (search && rule && is_regex_rule(search)) {
+            tmpl = compile_regex_rule(pool, search + 1, rule->replacement, nocase, &literal, &error);
+            if (tmpl) {
+                tmpl->regex_source = search + 1;
+                chain_template(pool, chains, literal, tmpl);
+            } else {
+                ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, pool,
+                              "mod_replace: ReplaceRegex '%s' skipped: %s", search + 1, error);
+            }
+        }
+    }
+
+    // Static rules keep their bytes in the automaton and are copied without
+    // a callback; only rules with variables, or sharing a regex's literal,
+    // carry a template as user_data
+    for (hi = apr_hash_first(pool, replacements); hi; hi = apr_hash_next(hi)) {
+        const char *search = NULL;
+        replace_rule *rule = NULL;
+        const char *replace_val;
+        replace_rule_options options;
+        bool added;
+        apr_hash_this(hi, (const void **)&search, NULL, (void **)&rule);
+
+        if (!search || !rule || is_regex_rule(search)) {
+            continue;
+        }
+        replace_val = rule->replacement;
+        options = rule->options;
+        if (apr_hash_get(chains, search, APR_HASH_KEY_STRING)) {
+            // The pattern serves the regexes too; the callback checks these boundaries
+            replacement_template_t *tmpl = compile_template(pool, replace_val, 0);
+            tmpl->options = options;
+            chain_template(pool, chains, search, tmpl);
+            continue;
+        }
+        if (replacement_has_variable(replace_val)) {
+            added = ac_add_pattern_ex(automaton, search, strlen(search), NULL, 0,
+                                      compile_template(pool, replace_val, 0));
+        } else {
+            added = ac_add_pattern_ex(automaton, search, strlen(search),
+                                      replace_val, strlen(replace_val), NULL);
+        }
+        if (!added) {
+            return reject_automaton(pool, automaton, search, "add the pattern");
+        }
+        if ((options.left || options.right) &&
+            !ac_set_boundaries(automaton, search, strlen(search), options.left, options.right)) {
+            return reject_automaton(pool, automaton, search, "set the boundaries");
+        }
+        if (options.contexts &&
+            !ac_set_contexts(automaton, search, strlen(search), options.contexts)) {
+            return reject_automaton(pool, automaton, search, "set the contexts");
+        }
+    }
+
+    // The callback cannot tell contexts, so the contexts of a literal rule
+    // sharing a regex's literal restrict the regexes as well
+    for (hi = apr_hash_first(pool, chains); hi; hi = apr_hash_next(hi)) {
+        const char *literal = NULL;
+        replacement_template_t **chain = NULL;
+        replacement_template_t *last;
+        apr_hash_this(hi, (const void **)&literal, NULL, (void **)&chain);
+        if (!ac_add_pattern_ex(automaton, literal, strlen(literal), NULL, 0, *chain)) {
+            return reject_automaton(pool, automaton, literal, "add the pattern");
+        }
+
+        for (last = *chain; last->next; last = last->next) {
+        }
+        if (!last->regex && last->options.contexts &&
+            !ac_set_contexts(automaton, literal, strlen(literal), last->options.contexts)) {
+            return reject_automaton(pool, automaton, literal, "set the contexts");
+        }
+    }
+
+    return automaton;
+}
+
+static ac_automaton_t *shared_automaton(apr_pool_t *pool, replace_config *config);
+static apr_status_t release_shared_automaton(void *data);
+
+static void compile_config_automaton(replace_config *config)
+{
+    if (!config->automaton_compiled && apr_hash_count(config->replacements) > 0) {
+        // Configs without rules never get an automaton; the others get theirs
+        // from the registry once all rules are known. A precompiled image
+        // built for the other case mode is replaced the same way.
+        if (config->automaton && config->automaton->case_insensitive != config_nocase(config)) {
+            config->automaton = NULL;
+        }
+        if (!config->automaton) {
+            config->automaton = shared_automaton(config->pool, config);
+            if (!config->automaton) {
+                return;
+            }
+        }
+
+        // Registered automata are compiled by their first user
+        if (config->automaton->is_compiled) {
+            config->automaton_compiled = 1;
+            return;
+        }
+#ifndef TEST_BUILD
+        apr_time_t compile_start = apr_time_now();
+#endif
+        if (ac_compile(config->automaton)) {
+            config->automaton_compiled = 1;
+#ifndef TEST_BUILD
+            apr_time_t compile_end = apr_time_now();
+            size_t node_count = 0, pattern_count = 0, memory_usage = 0;
+            ac_get_stats(config->automaton, &node_count, &pattern_count, &memory_usage);
+            
+            // Runs from post_config or merge, so there is no request_rec to log with
+            ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, config->pool,
+                         "mod_replace: Compiled precompiled automaton - compile_time=%d μs, "
+                         "patterns=%zu, nodes=%zu, memory=%zu bytes",
+                         (int)(compile_end - compile_start), pattern_count, node_count, memory_usage);
+#endif
+        }
+    }
+}
+
+static void *create_replace_config(apr_pool_t *pool, char *path)
+{
+    replace_config *cfg = apr_pcalloc(pool, sizeof(replace_config));
+    cfg->replacements = apr_hash_make(pool);
+    cfg->automaton = NULL;  // Built in post_config, and only if rules are defined
+    cfg->enabled = 0;
+    cfg->automaton_compiled = 0;
+    cfg->pool = pool;
+    cfg->rules_fingerprint = 0;
+    cfg->dynamic_rules = 0;
+    cfg->nonce_rules = 0;
+    cfg->cache_dir = NULL;
+    cfg->shared = ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_RUN_MPM;
+    cfg->sources = apr_array_make(pool, 1, sizeof(replace_rule_source));
+    cfg->has_rule_files = 0;
+    cfg->live = NULL;
+    cfg->scopes = NULL;
+    cfg->scope_count = 0;
+    cfg->nocase = -1;
+    cfg->scan_limit = -1;
+    cfg->scan_terminator = NULL;
+    
+    return cfg;
+}
+
+static apr_status_t release_generation(void *data)
+{
+    replace_generation *gen = (replace_generation *)data;
+
+    if (apr_atomic_dec32(&gen->refs) == 0) {
+        if (gen->shared) {
+            release_shared_automaton(gen->shared);
+        }
+        if (gen->borrowed[0]) {
+            release_generation(gen->borrowed[0]);
+        }
+        if (gen->borrowed[1]) {
+            release_generation(gen->borrowed[1]);
+        }
+        if (gen->pool) {
+            apr_pool_destroy(gen->pool);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static replace_generation *acquire_generation(replace_live *live)
+{
+    replace_generation *gen;
+
+    reload_lock();
+    gen = live->current;
+    apr_atomic_inc32(&gen->refs);
+    reload_unlock();
+    return gen;
+}
+
+/*
+ * The rules a config stands for right now. For a reloadable rule set this is
+ * a copy carrying the current generation, whose reference is dropped with
+ * pool or, when held is given, handed over to the caller.
+ */
+static replace_config *current_config(replace_config *cfg, apr_pool_t *pool, replace_generation **held)
+{
+    replace_generation *gen;
+    replace_config *view;
+
+    if (!cfg->live) {
+        return cfg;
+    }
+    gen = acquire_generation(cfg->live);
+    if (held) {
+        *held = gen;
+    } else {
+        apr_pool_cleanup_register(pool, gen, release_generation, apr_pool_cleanup_null);
+    }
+
+    view = apr_pmemdup(pool, cfg, sizeof(replace_config));
+    view->replacements = gen->replacements;
+    view->automaton = gen->automaton;
+    view->automaton_compiled = gen->automaton != NULL;
+    view->rules_fingerprint = gen->rules_fingerprint;
+    view->rules_digest = gen->rules_digest;
+    view->dynamic_rules = gen->dynamic_rules;
+    view->nonce_rules = gen->nonce_rules;
+    view->live = NULL;
+    return view;
+}
+
+/* Publish the compiled rules of a shared config as its first generation */
+static void create_live(apr_pool_t *pool, replace_config *config,
+                        replace_generation *borrowed0, replace_generation *borrowed1)
+{
+    replace_live *live = apr_pcalloc(pool, sizeof(replace_live));
+    replace_generation *gen = apr_pcalloc(pool, sizeof(replace_generation));
+
+    gen->replacements = config->replacements;
+    gen->automaton = config->automaton_compiled ? config->automaton : NULL;
+    gen->rules_fingerprint = config->rules_fingerprint;
+    gen->rules_digest = config->rules_digest;
+    gen->dynamic_rules = config->dynamic_rules;
+    gen->nonce_rules = config->nonce_rules;
+    gen->borrowed[0] = borrowed0;
+    gen->borrowed[1] = borrowed1;
+    gen->refs = 1;
+
+    live->config = config;
+    live->current = gen;
+    config->live = live;
+
+    reload_lock();
+    APR_ARRAY_PUSH(reload.lives, replace_live *) = live;
+    reload_unlock();
+}
+
+static int same_rules(apr_pool_t *pool, apr_hash_t *a, apr_hash_t *b)
+{
+    apr_hash_index_t *hi;
+
+    if (apr_hash_count(a) != apr_hash_count(b)) {
+        return 0;
+    }
+    for (hi = apr_hash_first(pool, a); hi; hi = apr_hash_next(hi)) {
+        const char *search = NULL;
+        const replace_rule *rule = NULL;
+        const replace_rule *other;
+        apr_hash_this(hi, (const void **)&search, NULL, (void **)&rule);
+
+        other = apr_hash_get(b, search, APR_HASH_KEY_STRING);
+        if (!other || !same_rule(other, rule)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Registered automaton for exactly these rules and case mode, NULL if none; call with the cache locked */
+static replace_shared_automaton *find_shared_automaton(apr_pool_t *pool, apr_uint64_t fingerprint,
+                                                       apr_hash_t *rules, int nocase)
+{
+    replace_shared_automaton *entry;
+
+    entry = apr_hash_get(merge_cache.automata, &fingerprint, sizeof(apr_uint64_t));
+    for (; entry; entry = entry->next) {
+        if (entry->automaton->case_insensitive == nocase &&
+            same_rules(pool, rules, entry->replacements)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Register an automaton for configs with exactly these rules; call with the
+ * cache locked. owner is the pool of a refcounted entry, NULL for one that
+ * lives as long as the configuration.
+ */
+static replace_shared_automaton *publish_shared_automaton(apr_uint64_t fingerprint, apr_hash_t *rules,
+                                                          ac_automaton_t *automaton, apr_pool_t *owner)
+{
+    replace_shared_automaton *entry = apr_pcalloc(owner ? owner : merge_cache.pool,
+                                                  sizeof(replace_shared_automaton));
+
+    entry->fingerprint = fingerprint;
+    entry->replacements = rules;
+    entry->automaton = automaton;
+    entry->pool = owner;
+    entry->refs = 1;
+    entry->next = apr_hash_get(merge_cache.automata, &fingerprint, sizeof(apr_uint64_t));
+    apr_hash_set(merge_cache.automata, &entry->fingerprint, sizeof(apr_uint64_t), entry);
+    merge_cache.automaton_count++;
+    return entry;
+}
+
+static apr_hash_t *copy_rules(apr_pool_t *pool, apr_hash_t *rules)
+{
+    apr_hash_t *copy = apr_hash_make(pool);
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(pool, rules); hi; hi = apr_hash_next(hi)) {
+        const char *search = NULL;
+        const replace_rule *rule = NULL;
+        apr_hash_this(hi, (const void **)&search, NULL, (void **)&rule);
+        apr_hash_set(copy, apr_pstrdup(pool, search), APR_HASH_KEY_STRING,
+                     make_rule(pool, apr_pstrdup(pool, rule->replacement), &rule->options));
+    }
+    return copy;
+}
+
+/*
+ * Build, compile and publish a refcounted entry for these rules, holding a
+ * reference to it. Compiling happens without the cache lock; if another
+ * thread published the same rules meanwhile, its entry is used and this
+ * copy is dropped.
+ */
+static replace_shared_automaton *compile_shared_automaton(apr_pool_t *scratch, apr_uint64_t fingerprint,
+                                                          apr_hash_t *rules, int nocase)
+{
+    replace_shared_automaton *entry;
+    ac_automaton_t *automaton;
+    apr_pool_t *pool;
+    apr_hash_t *copy;
+
+    // The entry may outlive the rule set that built it
+    if (apr_pool_create_unmanaged(&pool) != APR_SUCCESS) {
+        return NULL;
+    }
+    copy = copy_rules(pool, rules);
+    automaton = build_automaton(pool, copy, nocase);
+    if (!automaton || !ac_compile(automaton)) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+
+    merge_cache_lock();
+    entry = find_shared_automaton(scratch, fingerprint, rules, nocase);
+    if (entry) {
+        entry->refs++;
+        merge_cache_unlock();
+        apr_pool_destroy(pool);
+        return entry;
+    }
+    entry = publish_shared_automaton(fingerprint, copy, automaton, pool);
+    merge_cache_unlock();
+    return entry;
+}
+
+/*
+ * Find or build the automaton for a config's rule set. While the
+ * configuration is read, entries live with it and post_config compiles
+ * them. Afterwards entries are refcounted, held until pool is cleaned up,
+ * and compiled outside the cache lock before they are published, so
+ * concurrent users only ever see finished automata.
+ *
+ * After startup this is the one path that compiles at request time: merges
+ * of <Directory>/<Location> sections are only known once a request reaches
+ * them, and those the scoped automaton cannot serve (case-insensitive,
+ * reloadable or image rules, rules with options, regexes, .htaccess) are
+ * compiled by the first request of each child that needs them. Every
+ * combination of sections is not enumerable at startup, so this is logged
+ * at debug level rather than avoided.
+ */
+static ac_automaton_t *shared_automaton(apr_pool_t *pool, replace_config *config)
+{
+    replace_shared_automaton *entry;
+    ac_automaton_t *automaton;
+
+    merge_cache_lock();
+
+    entry = find_shared_automaton(pool, config->rules_fingerprint, config->replacements,
+                                  config_nocase(config));
+    if (entry) {
+        if (entry->pool) {
+            // Refcounted: hold it as long as this config
+            entry->refs++;
+            apr_pool_cleanup_register(pool, entry, release_shared_automaton, apr_pool_cleanup_null);
+        }
+        merge_cache_unlock();
+        return entry->automaton;
+    }
+
+    if (pending_configs) {
+        // Rules read with the configuration already live in pconf
+        automaton = build_automaton(merge_cache.pool, config->replacements, config_nocase(config));
+        if (automaton) {
+            publish_shared_automaton(config->rules_fingerprint, config->replacements, automaton, NULL);
+        }
+        merge_cache_unlock();
+        return automaton;
+    }
+
+    if (merge_cache.automaton_count >= REPLACE_MERGE_CACHE_MAX) {
+        merge_cache_unlock();
+        ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, pool,
+                      "mod_replace: Compiling a private automaton at request time for a merged "
+                      "rule set of %u rules (registry full)", apr_hash_count(config->replacements));
+        return build_automaton(pool, config->replacements, config_nocase(config));
+    }
+    merge_cache_unlock();
+
+    ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, pool,
+                  "mod_replace: Compiling an automaton at request time for a merged rule set of "
+                  "%u rules not covered by the scoped automaton", apr_hash_count(config->replacements));
+
+    // Rules of request-time configs (.htaccess) live in the request pool
+    entry = compile_shared_automaton(pool, config->rules_fingerprint, config->replacements,
+                                     config_nocase(config));
+    if (!entry) {
+        return NULL;
+    }
+    apr_pool_cleanup_register(pool, entry, release_shared_automaton, apr_pool_cleanup_null);
+    return entry->automaton;
+}
+
+/*
+ * Take a reference to the compiled automaton for a reloaded rule set,
+ * building a refcounted entry if no rule set in this process has these
+ * rules yet. Runs on the watcher thread.
+ */
+static replace_shared_automaton *acquire_shared_automaton(apr_pool_t *scratch, apr_uint64_t fingerprint,
+                                                          apr_hash_t *rules, int nocase)
+{
+    replace_shared_automaton *entry;
+
+    merge_cache_lock();
+    entry = find_shared_automaton(scratch, fingerprint, rules, nocase);
+    if (entry) {
+        entry->refs++;
+        merge_cache_unlock();
+        return entry;
+    }
+    merge_cache_unlock();
+
+    return compile_shared_automaton(scratch, fingerprint, rules, nocase);
+}
+
+static apr_status_t release_shared_automaton(void *data)
+{
+    replace_shared_automaton *entry = (replace_shared_automaton *)data;
+    replace_shared_automaton *head;
+
+    merge_cache_lock();
+    if (--entry->refs > 0 || !entry->pool) {
+        merge_cache_unlock();
+        return APR_SUCCESS;
+    }
+
+    head = apr_hash_get(merge_cache.automata, &entry->fingerprint, sizeof(apr_uint64_t));
+    if (head == entry) {
+        apr_hash_set(merge_cache.automata, &entry->fingerprint, sizeof(apr_uint64_t), NULL);
+        if (entry->next) {
+            apr_hash_set(merge_cache.automata, &entry->next->fingerprint, sizeof(apr_uint64_t),
+                         entry->next);
+        }
+    } else {
+        while (head->next != entry) {
+            head = head->next;
+        }
+        head->next = entry->next;
+    }
+    merge_cache.automaton_count--;
+    merge_cache_unlock();
+
+    apr_pool_destroy(entry->pool);
+    return APR_SUCCESS;
+}
+
+/* The scoped automaton holds literal rules without options only */
+static int has_unscoped_rules(apr_hash_t *replacements)
+{
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(NULL, replacements); hi; hi = apr_hash_next(hi)) {
+        const char *search = NULL;
+        const replace_rule *rule = NULL;
+        apr_hash_this(hi, (const void **)&search, NULL, (void **)&rule);
+        if (is_regex_rule(search) || has_rule_options(rule)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Rule sets fixed for the lifetime of the configuration can join the scoped automaton */
+static int scope_eligible(const replace_config *config)
+{
+    return apr_hash_count(config->replacements) > 0
+        && !config_nocase(config)
+        && !has_unscoped_rules(config->replacements)
+        && !(config->has_rule_files && reload.interval > 0)
+        && !(config->automaton && config->automaton->is_compiled);  // ReplaceRuleImage
+}
+
+/* Can be merged through the scoped automaton: scoped, or without rules that could appear later */
+static int scope_compatible(const replace_config *config)
+{
+    if (config->scopes) {
+        return 1;
+    }
+    return apr_hash_count(config->replacements) == 0
+        && !(config->has_rule_files && reload.interval > 0);
+}
+
+static replace_config *build_merged_config(apr_pool_t *pool, replace_config *parent, replace_config *new)
+{
+    replace_config *merged = apr_pcalloc(pool, sizeof(replace_config));
+    apr_hash_index_t *hi;
+    
+    merged->replacements = apr_hash_overlay(pool, new->replacements, parent->replacements);
+    merged->enabled = new->enabled ? new->enabled : parent->enabled;
+    merged->nocase = new->nocase != -1 ? new->nocase : parent->nocase;
+    merged->scan_limit = new->scan_limit != -1 ? new->scan_limit : parent->scan_limit;
+    merged->scan_terminator = new->scan_limit != -1 ? new->scan_terminator : parent->scan_terminator;
+    merged->automaton_compiled = 0;
+    merged->pool = pool;
+    merged->cache_dir = new->cache_dir ? new->cache_dir : parent->cache_dir;
+    merged->sources = apr_array_append(pool, parent->sources, new->sources);
+    merged->has_rule_files = parent->has_rule_files || new->has_rule_files;
+
+    for (hi = apr_hash_first(pool, merged->replacements); hi; hi = apr_hash_next(hi)) {
+        const char *search = NULL;
+        const replace_rule *rule = NULL;
+        apr_hash_this(hi, (const void **)&search, NULL, (void **)&rule);
+
+        merged->rules_fingerprint += rule_fingerprint(search, rule);
+        merged->dynamic_rules += replacement_has_variable(rule->replacement);
+        merged->nonce_rules += replacement_has_nonce(rule->replacement);
+    }
+    if (!pending_configs) {
+        digest_config_rules(pool, merged);
+    }
+
+    if (apr_hash_count(merged->replacements) > 0) {
+        if (scoped.automaton && !config_nocase(merged) &&
+            scope_compatible(parent) && scope_compatible(new)) {
+            int *scopes = apr_palloc(pool, (new->scope_count + parent->scope_count) * sizeof(int));
+
+            memcpy(scopes, new->scopes, new->scope_count * sizeof(int));
+            memcpy(scopes + new->scope_count, parent->scopes, parent->scope_count * sizeof(int));
+            merged->scopes = scopes;
+            merged->scope_count = new->scope_count + parent->scope_count;
+            merged->automaton = scoped.automaton;
+            merged->automaton_compiled = 1;
+        } else if (!pending_configs) {
+            merged->automaton = shared_automaton(pool, merged);
+        }
+    }
+
+    // Merged while the configuration is read: post_config scopes or compiles it
+    if (pending_configs) {
+        APR_ARRAY_PUSH(pending_configs, replace_config *) = merged;
+    } else {
+        compile_config_automaton(merged);
+    }
+    
+    return merged;
+}
+
+static apr_size_t merge_slot(const void *parent, const void *child)
+{
+    apr_uint64_t h = ((apr_uint64_t)(apr_uintptr_t)parent >> 4) * 0x9E3779B97F4A7C15ULL
+                   ^ ((apr_uint64_t)(apr_uintptr_t)child >> 4);
+
+    return (apr_size_t)(h ^ (h >> 32)) & (REPLACE_MERGE_SLOTS - 1);
+}
+
+/*
+ * Memoized merge of parent and child, NULL if none. Entries are only ever
+ * added, each published with a single atomic store once it is complete,
+ * so lookups need no lock.
+ */
+static replace_config *find_merged_config(const void *parent, const void *child)
+{
+    apr_size_t i = merge_slot(parent, child);
+    replace_merge_entry *entry;
+
+    while ((entry = merge_cache.merges[i]) != NULL) {
+        if (entry->key.parent == parent && entry->key.child == child) {
+            return entry->merged;
+        }
+        i = (i + 1) & (REPLACE_MERGE_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/* Memoize a merge; call with the cache locked and merge_count below the limit */
+static void publish_merged_config(apr_pool_t *pool, const void *parent, const void *child,
+                                  replace_config *merged)
+{
+    replace_merge_entry *entry = apr_palloc(pool, sizeof(replace_merge_entry));
+    apr_size_t i = merge_slot(parent, child);
+
+    entry->key.parent = parent;
+    entry->key.child = child;
+    entry->merged = merged;
+    while (merge_cache.merges[i]) {
+        i = (i + 1) & (REPLACE_MERGE_SLOTS - 1);
+    }
+    apr_atomic_casptr((volatile void **)&merge_cache.merges[i], entry, NULL);
+    merge_cache.merge_count++;
+}
+
+/* Adds no rules and overrides no option, so merging it yields the parent */
+static int overrides_nothing(const replace_config *config)
+{
+    return apr_hash_count(config->replacements) == 0 && config->sources->nelts == 0
+        && !config->enabled && config->nocase == -1 && config->scan_limit == -1
+        && !config->cache_dir;
+}
+
+static void *merge_replace_config(apr_pool_t *pool, void *parent_conf, void *new_conf)
+{
+    replace_config *parent = (replace_config *)parent_conf;
+    replace_config *new = (replace_config *)new_conf;
+    replace_config *merged = NULL;
+    replace_generation *held[2] = { NULL, NULL };
+    apr_pool_t *entry_pool;
+
+    if (overrides_nothing(new)) {
+        return parent;
+    }
+
+    if (!parent->shared || !new->shared) {
+        return build_merged_config(pool, current_config(parent, pool, NULL),
+                                   current_config(new, pool, NULL));
+    }
+
+    merged = find_merged_config(parent, new);
+    if (merged) {
+        return merged;
+    }
+
+    merge_cache_lock();
+    merged = find_merged_config(parent, new);
+    if (!merged && merge_cache.merge_count < REPLACE_MERGE_CACHE_MAX && pending_configs) {
+        // Read with the configuration: one thread, entries live in pconf
+        merged = build_merged_config(merge_cache.pool, parent, new);
+        merged->shared = 1;
+        publish_merged_config(merge_cache.pool, parent, new, merged);
+    }
+    if (merged || merge_cache.merge_count >= REPLACE_MERGE_CACHE_MAX || pending_configs) {
+        merge_cache_unlock();
+        return merged ? merged : build_merged_config(pool, current_config(parent, pool, NULL),
+                                                     current_config(new, pool, NULL));
+    }
+    merge_cache_unlock();
+
+    // Build without the lock, in a pool that lives as long as the process
+    if (apr_pool_create_unmanaged(&entry_pool) != APR_SUCCESS) {
+        return build_merged_config(pool, current_config(parent, pool, NULL),
+                                   current_config(new, pool, NULL));
+    }
+    merged = build_merged_config(entry_pool,
+                                 current_config(parent, entry_pool, &held[0]),
+                                 current_config(new, entry_pool, &held[1]));
+    merged->shared = 1;
+
+    merge_cache_lock();
+    if (find_merged_config(parent, new) || merge_cache.merge_count >= REPLACE_MERGE_CACHE_MAX) {
+        // Another thread got there first, or filled the cache
+        merge_cache_unlock();
+        if (held[0]) {
+            release_generation(held[0]);
+        }
+        if (held[1]) {
+            release_generation(held[1]);
+        }
+        apr_pool_destroy(entry_pool);
+        return merge_replace_config(pool, parent_conf, new_conf);
+    }
+    // A memoized merge of reloadable rules becomes reloadable itself; its
+    // first generation points into the generations it was merged from
+    if (merged->has_rule_files && reload.interval > 0) {
+        create_live(entry_pool, merged, held[0], held[1]);
+    }
+    publish_merged_config(entry_pool, parent, new, merged);
+    merge_cache_unlock();
+
+    return merged;
+}
+
+/* Add a rule to a config being read; search and rule must live as long as the config */
+static void add_replace_rule(replace_config *config, const char *search, replace_rule *rule)
+{
+    // A redefined rule replaces the previous one, options included, in the fingerprint as well
+    const replace_rule *previous = apr_hash_get(config->replacements, search, APR_HASH_KEY_STRING);
+    if (previous) {
+        config->rules_fingerprint -= rule_fingerprint(search, previous);
+        config->dynamic_rules -= replacement_has_variable(previous->replacement);
+        config->nonce_rules -= replacement_has_nonce(previous->replacement);
+    }
+    config->rules_fingerprint += rule_fingerprint(search, rule);
+    config->dynamic_rules += replacement_has_variable(rule->replacement);
+    config->nonce_rules += replacement_has_nonce(rule->replacement);
+
+    // Add to hash table
+    apr_hash_set(config->replacements, search, APR_HASH_KEY_STRING, rule);
+
+    // A precompiled automaton no longer covers the rules; rebuild in post_config
+    config->automaton = NULL;
+
+    // First rule of a server/directory config: build and compile its
+    // automaton in post_config. Rules read from .htaccess at request time
+    // only matter once merged, so they never get an automaton of their own
+    if (pending_configs && !previous && apr_hash_count(config->replacements) == 1) {
+        APR_ARRAY_PUSH(pending_configs, replace_config *) = config;
+    }
+}
+
+/* Consecutive ReplaceRule directives share one source */
+static apr_hash_t *inline_rule_source(apr_pool_t *pool, replace_config *config)
+{
+    replace_rule_source *source = NULL;
+
+    if (config->sources->nelts > 0) {
+        source = &APR_ARRAY_IDX(config->sources, config->sources->nelts - 1, replace_rule_source);
+    }
+    if (!source || !source->inline_rules) {
+        source = apr_array_push(config->sources);
+        source->file = NULL;
+        source->rules = apr_hash_make(pool);
+        source->inline_rules = 1;
+    }
+    return source->rules;
+}
+
+/* Boundary class named in a ReplaceRule; -1 if the name is unknown */
+static int parse_boundary(const char *name, apr_size_t len)
+{
+    static const char *const names[] = { "none", "word", "path", "attribute" };
+    int i;
+
+    for (i = 0; i <= AC_BOUNDARY_MAX; i++) {
+        if (strlen(names[i]) == len && ap_cstr_casecmpn(name, names[i], len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Context named in a ReplaceRule; 0 if the name is unknown */
+static unsigned parse_context(const char *name, apr_size_t len)
+{
+    static const struct {
+        const char *name;
+        unsigned mask;
+    } contexts[] = {
+        { "text", AC_CONTEXT_TEXT },
+        { "tag", AC_CONTEXT_TAG },
+        { "attribute", AC_CONTEXT_ATTRIBUTE },
+        { "script", AC_CONTEXT_SCRIPT },
+        { "comment", AC_CONTEXT_COMMENT }
+    };
+    int i;
+
+    for (i = 0; i < (int)(sizeof(contexts) / sizeof(contexts[0])); i++) {
+        if (strlen(contexts[i].name) == len && ap_cstr_casecmpn(name, contexts[i].name, len) == 0) {
+            return contexts[i].mask;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Options after the replacement of a ReplaceRule: boundaries ("word" for
+ * both sides, "none,path" for each side on its own) and "context=" with a
+ * comma-separated list of contexts, or "context=!..." for all but those.
+ */
+static const char *parse_rule_option(apr_pool_t *pool, const char *arg, replace_rule_options *options)
+{
+    const char *comma;
+    int left, right;
+
+    if (ap_cstr_casecmpn(arg, "context=", 8) == 0) {
+        const char *list = arg + 8;
+        int negate = *list == '!';
+        unsigned mask = 0;
+
+        for (list += negate; list; list = comma ? comma + 1 : NULL) {
+            unsigned context;
+            comma = strchr(list, ',');
+            context = parse_context(list, comma ? (apr_size_t)(comma - list) : strlen(list));
+            if (!context) {
+                return apr_pstrcat(pool, "ReplaceRule: unknown context in '", arg,
+                                   "' (text, tag, attribute, script or comment)", NULL);
+            }
+            mask |= context;
+        }
+        options->contexts = negate ? AC_CONTEXT_ALL & ~mask : mask;
+        if (!options->contexts) {
+            return "ReplaceRule: context=! excludes every context";
+        }
+        return NULL;
+    }
+
+    comma = strchr(arg, ',');
+    left = parse_boundary(arg, comma ? (apr_size_t)(comma - arg) : strlen(arg));
+    right = comma ? parse_boundary(comma + 1, strlen(comma + 1)) : left;
+    if (left < 0 || right < 0) {
+        return apr_pstrcat(pool, "ReplaceRule: unknown boundary '", arg,
+                           "' (none, word, path or attribute, or two separated by a comma)", NULL);
+    }
+    options->left = (ac_boundary_t)left;
+    options->right = (ac_boundary_t)right;
+    return NULL;
+}
+
+static const char *set_replace_rule(cmd_parms *cmd, void *cfg, int argc, char *const argv[])
+{
+    replace_config *config = (replace_config *)cfg;
+    replace_rule_options options = { AC_BOUNDARY_NONE, AC_BOUNDARY_NONE, 0 };
+    const char *search, *replace;
+    replace_rule *rule;
+    int i;
+    
+    if (argc < 2 || argc > 4) {
+        return "ReplaceRule requires search and replace parameters, then optional "
+               "boundaries and context=";
+    }
+    search = argv[0];
+    replace = argv[1];
+    for (i = 2; i < argc; i++) {
+        const char *error = parse_rule_option(cmd->pool, argv[i], &options);
+        if (error) {
+            return error;
+        }
+    }
+    
+    // Report expression errors with the directive; the automaton parses it again
+    if (strncmp(replace, REPLACE_EXPR_PREFIX, REPLACE_EXPR_PREFIX_LEN) == 0) {
+        const char *err = NULL;
+        ap_expr_parse_cmd(cmd, replace + REPLACE_EXPR_PREFIX_LEN, AP_EXPR_FLAG_STRING_RESULT, &err, NULL);
+        if (err) {
+            return apr_pstrcat(cmd->pool, "ReplaceRule: cannot parse expression '",
+                               replace + REPLACE_EXPR_PREFIX_LEN, "': ", err, NULL);
+        }
+    }
+
+    search = apr_pstrdup(cmd->pool, search);
+    rule = make_rule(cmd->pool, apr_pstrdup(cmd->pool, replace), &options);
+    add_replace_rule(config, search, rule);
+    apr_hash_set(inline_rule_source(cmd->pool, config), search, APR_HASH_KEY_STRING, rule);
+    return NULL;
+}
+
+static const char *set_replace_regex(cmd_parms *cmd, void *cfg, const char *regex, const char *replace)
+{
+    replace_config *config = (replace_config *)cfg;
+    const char *literal, *error, *search;
+    replace_rule *rule;
+
+    // Compiled again with the automaton, once the case mode is known
+    if (!compile_regex_rule(cmd->temp_pool, regex, replace, 0, &literal, &error)) {
+        return apr_pstrcat(cmd->pool, "ReplaceRegex: '", regex, "': ", error, NULL);
+    }
+    if (strncmp(replace, REPLACE_EXPR_PREFIX, REPLACE_EXPR_PREFIX_LEN) == 0) {
+        const char *err = NULL;
+        ap_expr_parse_cmd(cmd, replace + REPLACE_EXPR_PREFIX_LEN, AP_EXPR_FLAG_STRING_RESULT, &err, NULL);
+        if (err) {
+            return apr_pstrcat(cmd->pool, "ReplaceRegex: cannot parse expression '",
+                               replace + REPLACE_EXPR_PREFIX_LEN, "': ", err, NULL);
+        }
+    }
+
+    search = apr_pstrcat(cmd->pool, REPLACE_REGEX_KEY, regex, NULL);
+    rule = make_rule(cmd->pool, apr_pstrdup(cmd->pool, replace), NULL);
+    add_replace_rule(config, search, rule);
+    apr_hash_set(inline_rule_source(cmd->pool, config), search, APR_HASH_KEY_STRING, rule);
+    return NULL;
+}
+
+typedef void (*replace_rule_sink)(void *baton, const char *search, replace_rule *rule);
+
+/*
+ * Rule files are parsed a line at a time through a buffer of this size, and
+ * their rules are copied into a string arena: one block the size of the file,
+ * which holds all of its rules, then blocks of REPLACE_RULE_ARENA_BLOCK bytes
+ * if the file grew while it was read. Lines longer than the buffer fail the
+ * file.
+ */
+#define REPLACE_RULE_LINE_MAX 8192
+#define REPLACE_RULE_ARENA_BLOCK (64 * 1024)
+
+/*
+ * Read "search|replace" rules, one per line, from a file. The text of the
+ * rules goes into a string arena of large pool blocks, so a rule costs its
+ * bytes and its hash entry rather than an allocation per string. Empty
+ * lines and lines starting with '#' are skipped; a trailing CR is ignored.
+ * An "expr=" value that does not parse fails the whole file, at startup as
+ * on reload, rather than being served as literal text.
+ */
+static const char *read_rule_file(apr_pool_t *pool, const char *path,
+                                  replace_rule_sink sink, void *baton,
+                                  apr_finfo_t *finfo, int *rule_count, apr_size_t *arena_size)
+{
+    char line[REPLACE_RULE_LINE_MAX];
+    char *arena = NULL;
+    apr_size_t arena_free = 0;
+    apr_file_t *fd;
+    apr_status_t rv;
+    const char *error = NULL;
+    int line_number = 0;
+
+    *rule_count = 0;
+    *arena_size = 0;
+    rv = apr_file_open(&fd, path, APR_READ | APR_BINARY | APR_BUFFERED, APR_OS_DEFAULT, pool);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_info_get(finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, fd);
+        if (rv != APR_SUCCESS) {
+            apr_file_close(fd);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        char reason[120];
+        return apr_psprintf(pool, "cannot read %s: %s", path, apr_strerror(rv, reason, sizeof(reason)));
+    }
+
+    while (!error && (rv = apr_file_gets(line, sizeof(line), fd)) == APR_SUCCESS) {
+        apr_size_t length = strlen(line);
+        char *sep, *search;
+
+        line_number++;
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        } else if (length == sizeof(line) - 1) {
+            error = apr_psprintf(pool, "%s:%d: line longer than %d bytes",
+                                 path, line_number, REPLACE_RULE_LINE_MAX - 2);
+            break;
+        }
+        if (length > 0 && line[length - 1] == '\r') {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+
+        sep = strchr(line, '|');
+        if (!sep || sep == line) {
+            error = apr_psprintf(pool, "%s:%d: expected search|replace", path, line_number);
+            break;
+        }
+        *sep = '\0';
+        error = replacement_expr_error(pool, sep + 1);
+        if (error) {
+            error = apr_psprintf(pool, "%s:%d: %s", path, line_number, error);
+            break;
+        }
+
+        // Both strings, NUL included, take the line's bytes
+        if (length + 1 > arena_free) {
+            arena_free = REPLACE_RULE_ARENA_BLOCK;
+            if (*arena_size == 0 && (apr_size_t)finfo->size + 1 > length + 1) {
+                arena_free = (apr_size_t)finfo->size + 1;
+            }
+            arena = apr_palloc(pool, arena_free);
+            *arena_size += arena_free;
+        }
+        search = memcpy(arena, line, length + 1);
+        arena += length + 1;
+        arena_free -= length + 1;
+        sink(baton, search, make_rule(pool, search + (sep - line) + 1, NULL));
+        (*rule_count)++;
+    }
+    apr_file_close(fd);
+
+    if (!error && rv != APR_EOF) {
+        char reason[120];
+        error = apr_psprintf(pool, "cannot read %s: %s", path, apr_strerror(rv, reason, sizeof(reason)));
+    }
+    return error;
+}
+
+static void add_rule_to_config(void *baton, const char *search, replace_rule *rule)
+{
+    add_replace_rule((replace_config *)baton, search, rule);
+}
+
+static void add_rule_to_table(void *baton, const char *search, replace_rule *rule)
+{
+    apr_hash_set((apr_hash_t *)baton, search, APR_HASH_KEY_STRING, rule);
+}
+
+static const char *set_replace_rule_file(cmd_parms *cmd, void *cfg, const char *file)
 {
-    replace_config *parent = (replace_config *)parent_conf;
-    replace_config *new = (replace_config *)new_conf;
-    replace_config *merged = apr_pcalloc(pool, sizeof(replace_config));
-    
-    merged->replacements = apr_hash_overlay(pool, new->replacements, parent->replacements);
-    merged->enabled = new->enabled ? new->enabled : parent->enabled;
-    merged->automaton = ac_create(0);
-    merged->automaton_compiled = 0;
-    merged->pool = pool;
-    
-    // Register cleanup for merged automaton
-    if (merged->automaton) {
-        apr_pool_cleanup_register(pool, merged->automaton, cleanup_automaton, apr_pool_cleanup_null);
+    replace_config *config = (replace_config *)cfg;
+    apr_time_t start = apr_time_now();
+    const char *path = ap_server_root_relative(cmd->pool, file);
+    int registered = apr_hash_count(config->replacements) > 0 || config->has_rule_files;
+    replace_rule_source *source;
+    apr_finfo_t finfo;
+    apr_size_t arena_size;
+    const char *error;
+    int rule_count;
 
-        // Add all patterns from merged replacements to automaton with templates
-        apr_hash_index_t *hi;
-        for (hi = apr_hash_first(pool, merged->replacements); hi; hi = apr_hash_next(hi)) {
-            const char *search = NULL;
-            char *replace_val = NULL;
-            apr_hash_this(hi, (const void **)&search, NULL, (void **)&replace_val);
+    if (!path) {
+        return apr_pstrcat(cmd->pool, "Invalid ReplaceRuleFile path ", file, NULL);
+    }
+    error = read_rule_file(cmd->pool, path, add_rule_to_config, config, &finfo, &rule_count,
+                           &arena_size);
+    if (error) {
+        return apr_pstrcat(cmd->pool, "ReplaceRuleFile: ", error, NULL);
+    }
 
-            if (search && replace_val) {
-                // Create template structure
-                replacement_template_t *tmpl = apr_pcalloc(pool, sizeof(replacement_template_t));
-                tmpl->replacement_template = replace_val;
-                tmpl->pool = pool;
+    source = apr_array_push(config->sources);
+    source->file = path;
+    source->rules = NULL;
+    source->inline_rules = 0;
+    config->has_rule_files = 1;
 
-                // Use ac_add_pattern_ex with template as user_data
-                ac_add_pattern_ex(merged->automaton,
-                                 search, strlen(search),
-                                 NULL, 0,  // No static replacement
-                                 tmpl);    // Template as user_data
-            }
+    // Files read at startup are watched by ReplaceReloadInterval; a config
+    // whose files are all empty still needs a rule set to reload into
+    if (pending_configs) {
+        replace_watched_file *watched = apr_pcalloc(cmd->pool, sizeof(replace_watched_file));
+        watched->path = path;
+        watched->mtime = finfo.mtime;
+        watched->size = finfo.size;
+        apr_hash_set(reload.files, path, APR_HASH_KEY_STRING, watched);
+
+        if (!registered && apr_hash_count(config->replacements) == 0) {
+            APR_ARRAY_PUSH(pending_configs, replace_config *) = config;
         }
     }
-    
-    return merged;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, cmd->server,
+                 "mod_replace: Loaded %d rules from %s in %d μs - arena=%" APR_SIZE_T_FMT
+                 " bytes, rule_table=%u entries",
+                 rule_count, path, (int)(apr_time_now() - start), arena_size,
+                 apr_hash_count(config->replacements));
+    return NULL;
 }
 
-static const char *set_replace_rule(cmd_parms *cmd, void *cfg, const char *search, const char *replace)
+/*
+ * Use an automaton compiled ahead of time by replace_compile. The file is
+ * mapped and searched in place, so startup cost does not grow with the rule
+ * count. Its rules also join the rule table, for merging and fingerprints;
+ * when the context has other rules as well, post_config compiles them all
+ * into a fresh automaton as usual.
+ */
+static const char *set_replace_rule_image(cmd_parms *cmd, void *cfg, const char *file)
 {
     replace_config *config = (replace_config *)cfg;
-    
-    if (!search || !replace) {
-        return "ReplaceRule requires both search and replace parameters";
+    apr_time_t start = apr_time_now();
+    const char *path = ap_server_root_relative(cmd->pool, file);
+    ac_automaton_t *image;
+    replace_rule_source *source;
+    size_t pattern_count = 0, id;
+    const char *error;
+    replace_rule *rule;
+    int standalone = apr_hash_count(config->replacements) == 0;
+
+    if (!path) {
+        return apr_pstrcat(cmd->pool, "Invalid ReplaceRuleImage path ", file, NULL);
     }
-    
-    // Add to hash table
-    apr_hash_set(config->replacements, apr_pstrdup(cmd->pool, search),
-                 APR_HASH_KEY_STRING, apr_pstrdup(cmd->pool, replace));
+    image = ac_load(path);
+    if (!image) {
+        return apr_pstrcat(cmd->pool, "ReplaceRuleImage: cannot load ", path,
+                           " (missing, damaged, or built by another version or on a host "
+                           "with another byte order)", NULL);
+    }
+    // The rule strings point into the mapping, which stays until the configuration goes away
+    apr_pool_cleanup_register(cmd->pool, image, cleanup_automaton, apr_pool_cleanup_null);
 
-    // Add to automaton if it exists
-    if (config->automaton && !config->automaton_compiled) {
-        // Create template structure to store replacement template
-        replacement_template_t *tmpl = apr_pcalloc(cmd->pool, sizeof(replacement_template_t));
-        tmpl->replacement_template = apr_pstrdup(cmd->pool, replace);
-        tmpl->pool = cmd->pool;
+    source = apr_array_push(config->sources);
+    source->file = NULL;
+    source->rules = apr_hash_make(cmd->pool);
+    source->inline_rules = 0;
+
+    ac_get_stats(image, NULL, &pattern_count, NULL);
+    for (id = 0; id < pattern_count; id++) {
+        const char *search = NULL, *replace = NULL;
+        ac_get_pattern(image, id, &search, NULL, &replace, NULL);
+        if (!replace) {
+            return apr_pstrcat(cmd->pool, "ReplaceRuleImage: ", path,
+                               " was not compiled from replacement rules", NULL);
+        }
+        error = replacement_expr_error(cmd->temp_pool, replace);
+        if (error) {
+            return apr_psprintf(cmd->pool, "ReplaceRuleImage: %s: rule '%s': %s", path, search, error);
+        }
+        rule = make_rule(cmd->pool, replace, NULL);
+        add_replace_rule(config, search, rule);
+        apr_hash_set(source->rules, search, APR_HASH_KEY_STRING, rule);
 
-        // Use ac_add_pattern_ex to store template as user_data
-        // This allows variable expansion via callback without recompiling
-        if (!ac_add_pattern_ex(config->automaton,
-                              search, strlen(search),
-                              NULL, 0,  // No static replacement
-                              tmpl)) {  // Template as user_data
-            return "Failed to add pattern to Aho-Corasick automaton";
+        // Static rules are served from the image's own replacement strings
+        if (replacement_has_variable(replace)) {
+            ac_set_user_data(image, id, compile_template(cmd->pool, replace, 0));
         }
     }
 
+    // Other configs with the same rules reuse the image; .htaccess
+    // rules live in the request pool, so they are never published
+    if (standalone) {
+        config->automaton = image;
+    }
+    if (standalone && pending_configs) {
+        merge_cache_lock();
+        publish_shared_automaton(config->rules_fingerprint,
+                                 apr_hash_copy(cmd->pool, config->replacements), image, NULL);
+        merge_cache_unlock();
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, cmd->server,
+                 "mod_replace: Loaded %" APR_SIZE_T_FMT " precompiled rules from %s in %d μs",
+                 pattern_count, path, (int)(apr_time_now() - start));
     return NULL;
 }
 
@@ -181,56 +2298,181 @@ static const char *set_replace_enable(cmd_parms *cmd, void *cfg, int flag)
     return NULL;
 }
 
-static void ensure_automaton_compiled(replace_config *config)
+static const char *set_replace_case_insensitive(cmd_parms *cmd, void *cfg, int flag)
 {
-    if (config->automaton && !config->automaton_compiled && apr_hash_count(config->replacements) > 0) {
-#ifndef TEST_BUILD
-        apr_time_t compile_start = apr_time_now();
-#endif
-        if (ac_compile(config->automaton)) {
-            config->automaton_compiled = 1;
-#ifndef TEST_BUILD
-            apr_time_t compile_end = apr_time_now();
-            size_t node_count = 0, pattern_count = 0, memory_usage = 0;
-            ac_get_stats(config->automaton, &node_count, &pattern_count, &memory_usage);
-            
-            // We can't use ap_log_rerror here as we don't have request_rec
-            // This will go to the main Apache error log
-            ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, config->pool,
-                         "mod_replace: Compiled precompiled automaton - compile_time=%d μs, "
-                         "patterns=%zu, nodes=%zu, memory=%zu bytes",
-                         (int)(compile_end - compile_start), pattern_count, node_count, memory_usage);
-#endif
+    replace_config *config = (replace_config *)cfg;
+    config->nocase = flag;
+    return NULL;
+}
+
+/* "ReplaceScanLimit 65536", "ReplaceScanLimit </head>", both, or "off" */
+static const char *set_replace_scan_limit(cmd_parms *cmd, void *cfg, const char *arg1, const char *arg2)
+{
+    replace_config *config = (replace_config *)cfg;
+    const char *args[2] = { arg1, arg2 };
+    int i;
+
+    config->scan_limit = 0;
+    config->scan_terminator = NULL;
+    if (!arg2 && ap_cstr_casecmp(arg1, "off") == 0) {
+        return NULL;
+    }
+    for (i = 0; i < 2 && args[i]; i++) {
+        char *end;
+        apr_int64_t bytes = apr_strtoi64(args[i], &end, 10);
+
+        if (end != args[i] && !*end) {
+            if (bytes <= 0 || config->scan_limit) {
+                return "ReplaceScanLimit takes one positive number of bytes";
+            }
+            config->scan_limit = (apr_off_t)bytes;
+        } else if (config->scan_terminator || !*args[i]) {
+            return "ReplaceScanLimit takes one non-empty terminator";
+        } else {
+            config->scan_terminator = apr_pstrdup(cmd->pool, args[i]);
         }
     }
+    return NULL;
 }
 
-static char *expand_replacement_value(apr_pool_t *pool, const char *replace_val, request_rec *r)
+static const char *set_replace_reload_interval(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    if (!replace_val) return apr_pstrdup(pool, "");
-    
-    // Support both ${VAR} and %{VAR} formats
-    if (strlen(replace_val) > 2 && 
-        ((replace_val[0] == '$' && replace_val[1] == '{') ||
-         (replace_val[0] == '%' && replace_val[1] == '{'))) {
-        char *var_end = strchr(replace_val + 2, '}');
-        if (var_end && var_end > replace_val + 2) {
-            char *var_name = apr_pstrndup(pool, replace_val + 2, var_end - replace_val - 2);
-            const char *env_val = NULL;
-            
-            if (r && r->subprocess_env) {
-                env_val = apr_table_get(r->subprocess_env, var_name);
+    const char *error = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+    long seconds;
+
+    if (error) {
+        return error;
+    }
+    seconds = strtol(arg, &end, 10);
+    if (end == arg || *end || seconds < 0) {
+        return "ReplaceReloadInterval takes a number of seconds (0 disables reloading)";
+    }
+    reload.interval = apr_time_from_sec(seconds);
+    return NULL;
+}
+
+static const char *set_replace_cache_dir(cmd_parms *cmd, void *cfg, const char *dir)
+{
+    replace_config *config = (replace_config *)cfg;
+    config->cache_dir = ap_server_root_relative(cmd->pool, dir);
+    if (!config->cache_dir) {
+        return apr_pstrcat(cmd->pool, "Invalid ReplaceCacheDir path ", dir, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * Resolve a variable or expression at most once per response: a page
+ * repeating one placeholder thousands of times costs one provider call,
+ * table lookup or evaluation, then a memcpy per occurrence.
+ */
+static const char *resolve_variable(apr_pool_t *pool, const replace_expand_ctx *ctx,
+                                    const replace_segment *segment, apr_size_t *len)
+{
+    replace_variable_value *memo;
+    const char *value = NULL;
+
+    // Groups belong to the match being expanded, never to the response
+    if (segment->type == REPLACE_SEGMENT_GROUP) {
+        const ap_regmatch_t *group = &ctx->groups[segment->group];
+        if (!ctx->subject || group->rm_so < 0) {
+            *len = 0;
+            return "";
+        }
+        *len = (apr_size_t)(group->rm_eo - group->rm_so);
+        return ctx->subject + group->rm_so;
+    }
+
+    memo = apr_hash_get(ctx->variables, segment->text, segment->len);
+    if (!memo) {
+        if (segment->type == REPLACE_SEGMENT_EXPR) {
+            if (ctx->r) {
+                const char *err = NULL;
+                value = ap_expr_str_exec(ctx->r, segment->expr, &err);
+                if (err) {
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, ctx->r,
+                                  "mod_replace: cannot evaluate %s: %s", segment->text, err);
+                    value = "";
+                }
             }
-            if (!env_val) {
-                env_val = getenv(var_name);
+        } else if (ctx->r && segment->provider != REPLACE_NO_PROVIDER) {
+            value = replace_providers[segment->provider].value(ctx->r);
+        } else {
+            if (ctx->r && ctx->r->subprocess_env) {
+                value = apr_table_get(ctx->r->subprocess_env, segment->text);
             }
-            if (env_val) {
-                return apr_pstrdup(pool, env_val);
+            if (!value) {
+                value = segment->environment;
             }
         }
+
+        memo = apr_palloc(pool, sizeof(replace_variable_value));
+        memo->value = value;
+        memo->len = value ? strlen(value) : 0;
+        apr_hash_set(ctx->variables, segment->text, segment->len, memo);
     }
-    
-    return apr_pstrdup(pool, replace_val);
+    *len = memo->len;
+    return memo->value;
+}
+
+/*
+ * Expand a compiled template. The result is only read until the response
+ * is rewritten, so single segments are returned in place; longer templates
+ * are sized in one pass and written in a second. An unset variable expands
+ * to its own reference, leaving the rest of the value intact.
+ */
+static const char *expand_template(apr_pool_t *pool, const replacement_template_t *tmpl,
+                                   const replace_expand_ctx *ctx, apr_size_t *len)
+{
+    const char **values;
+    apr_size_t *value_lens;
+    apr_size_t total = tmpl->literal_len;
+    char *result, *out;
+    int i;
+
+    if (tmpl->segment_count == 1) {
+        const replace_segment *segment = &tmpl->segments[0];
+        const char *value;
+
+        if (segment->type == REPLACE_SEGMENT_LITERAL) {
+            *len = segment->len;
+            return segment->text;
+        }
+        value = resolve_variable(pool, ctx, segment, len);
+        if (!value) {
+            *len = segment->reference_len;
+            return segment->reference;
+        }
+        return value;
+    }
+
+    values = apr_palloc(pool, tmpl->segment_count * sizeof(const char *));
+    value_lens = apr_palloc(pool, tmpl->segment_count * sizeof(apr_size_t));
+    for (i = 0; i < tmpl->segment_count; i++) {
+        const replace_segment *segment = &tmpl->segments[i];
+
+        if (segment->type == REPLACE_SEGMENT_LITERAL) {
+            values[i] = segment->text;
+            value_lens[i] = segment->len;
+            continue;
+        }
+        values[i] = resolve_variable(pool, ctx, segment, &value_lens[i]);
+        if (!values[i]) {
+            values[i] = segment->reference;
+            value_lens[i] = segment->reference_len;
+        }
+        total += value_lens[i];
+    }
+
+    out = result = apr_palloc(pool, total + 1);
+    for (i = 0; i < tmpl->segment_count; i++) {
+        memcpy(out, values[i], value_lens[i]);
+        out += value_lens[i];
+    }
+    *out = '\0';
+    *len = total;
+    return result;
 }
 
 static const char *expand_replacement_callback(
@@ -240,38 +2482,133 @@ static const char *expand_replacement_callback(
     void *context_data,
     size_t *replacement_len
 ) {
+    replace_expand_ctx *ctx = (replace_expand_ctx *)context_data;
     replacement_template_t *tmpl = (replacement_template_t *)user_data;
-    request_rec *r = (request_rec *)context_data;
+
+    // In the scoped automaton, take the replacement of the first of the
+    // config's scopes that has one; decline the match if none does
+    if (ctx->cfg->scopes) {
+        const replace_scoped_rule *rule = (const replace_scoped_rule *)user_data;
+        int i, v;
+
+        tmpl = NULL;
+        for (i = 0; i < ctx->cfg->scope_count && !tmpl; i++) {
+            int scope = ctx->cfg->scopes[i];
+            for (v = 0; v < rule->count; v++) {
+                if (rule->variants[v].mask[scope / 64] & (APR_UINT64_C(1) << (scope % 64))) {
+                    tmpl = rule->variants[v].tmpl;
+                    break;
+                }
+            }
+        }
+        if (!tmpl) {
+            return NULL;
+        }
+    }
 
     if (!tmpl || !tmpl->replacement_template) {
         *replacement_len = 0;
         return "";
     }
 
-    // Expand variables in the template using the request context
-    char *expanded = expand_replacement_value(tmpl->pool,
-                                             tmpl->replacement_template,
-                                             r);
+    return expand_template(ctx->pool, tmpl, ctx, replacement_len);
+}
+
+/*
+ * Callback of configs with ReplaceRegex rules. A hit of a literal runs the
+ * regexes chained to it over a window around the hit, each stepping through
+ * its leftmost non-overlapping matches as a global replace would; the first
+ * match that covers the hit replaces that match. Each regex thus reads the
+ * window about once. Without such a match, a literal rule for the same
+ * string applies, and otherwise the hit is left alone.
+ */
+static const char *expand_regex_callback(
+    const char *text,
+    size_t text_len,
+    size_t min_start,
+    ac_match_t *match,
+    void *user_data,
+    void *context_data,
+    size_t *replacement_len
+) {
+    replace_expand_ctx *ctx = (replace_expand_ctx *)context_data;
+    replacement_template_t *tmpl = (replacement_template_t *)user_data;
+    const char *replacement;
+    size_t from, to;
+
+    if (ctx->cfg->scopes || !tmpl || !tmpl->regex) {
+        return expand_replacement_callback(match->pattern, match->pattern_len, user_data,
+                                           context_data, replacement_len);
+    }
+
+    from = match->start_pos > REPLACE_REGEX_WINDOW ? match->start_pos - REPLACE_REGEX_WINDOW : 0;
+    if (from < min_start) {
+        from = min_start;
+    }
+    to = text_len - match->end_pos > REPLACE_REGEX_WINDOW + 1
+             ? match->end_pos + 1 + REPLACE_REGEX_WINDOW
+             : text_len;
+
+    for (; tmpl && tmpl->regex; tmpl = tmpl->next) {
+        int eflags = (from > 0 ? AP_REG_NOTBOL : 0) | (to < text_len ? AP_REG_NOTEOL : 0);
+        size_t offset = from;
+
+        // A later match in the window may still cover the hit
+        while (offset <= match->start_pos &&
+               ap_regexec_len(tmpl->regex, text + offset, to - offset,
+                              AP_MAX_REG_MATCH, ctx->groups, eflags) == 0) {
+            size_t start = offset + (size_t)ctx->groups[0].rm_so;
+            size_t end = offset + (size_t)ctx->groups[0].rm_eo;
+            int g;
+
+            if (start > match->start_pos || end == start) {
+                break;
+            }
+            if (end > match->end_pos) {
+                for (g = 0; g < AP_MAX_REG_MATCH; g++) {
+                    if (ctx->groups[g].rm_so >= 0) {
+                        ctx->groups[g].rm_so += (int)(offset - start);
+                        ctx->groups[g].rm_eo += (int)(offset - start);
+                    }
+                }
+                match->start_pos = start;
+                match->end_pos = end - 1;
+                ctx->subject = text + start;
+                replacement = expand_template(ctx->pool, tmpl, ctx, replacement_len);
+                ctx->subject = NULL;
+                return replacement;
+            }
+            offset = end;
+            eflags |= AP_REG_NOTBOL;
+        }
+    }
 
-    *replacement_len = expanded ? strlen(expanded) : 0;
-    return expanded ? expanded : "";
+    // No regex matched here; the literal rule sharing the pattern, if any
+    if (!tmpl || ((tmpl->options.left || tmpl->options.right) &&
+                  !ac_boundaries_hold(text, text_len, match->start_pos, match->end_pos,
+                                      tmpl->options.left, tmpl->options.right))) {
+        return NULL;
+    }
+    return expand_template(ctx->pool, tmpl, ctx, replacement_len);
 }
 
-static char *perform_replacements(apr_pool_t *pool, const char *input, apr_hash_t *replacements, request_rec *r)
+/*
+ * Rewrite the first scan_len of input_len bytes of input, which may contain
+ * NUL bytes and need not be NUL-terminated. Bytes past scan_len are copied
+ * as they are, but decide the boundaries of matches ending at scan_len - 1.
+ * The result lives in pool; *out_len is its length.
+ */
+static char *perform_replacements(apr_pool_t *pool, const char *input, apr_size_t input_len,
+                                  apr_size_t scan_len, replace_config *cfg, request_rec *r,
+                                  apr_hash_t *variables, apr_size_t *out_len)
 {
-    if (!input || !replacements || apr_hash_count(replacements) == 0) {
-        return apr_pstrdup(pool, input);
+    *out_len = input_len;
+    if (!input || !cfg || apr_hash_count(cfg->replacements) == 0) {
+        return (char *)input;
     }
 
     apr_time_t start_time = apr_time_now();
-    size_t input_len = strlen(input);
-    size_t pattern_count = apr_hash_count(replacements);
-
-    // Get config from request to access precompiled automaton
-    replace_config *cfg = NULL;
-    if (r) {
-        cfg = ap_get_module_config(r->per_dir_config, &replace_module);
-    }
+    size_t pattern_count = apr_hash_count(cfg->replacements);
 
 #ifndef TEST_BUILD
     if (r) {
@@ -283,7 +2620,7 @@ static char *perform_replacements(apr_pool_t *pool, const char *input, apr_hash_
 
     // ALWAYS use precompiled automaton with callback
     // This works for both static replacements AND variable expansion
-    if (cfg && cfg->automaton && cfg->automaton_compiled) {
+    if (cfg->automaton && cfg->automaton_compiled) {
 #ifndef TEST_BUILD
         if (r) {
             ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
@@ -292,14 +2629,17 @@ static char *perform_replacements(apr_pool_t *pool, const char *input, apr_hash_
 #endif
         apr_time_t ac_start = apr_time_now();
         size_t result_len;
+        replace_expand_ctx expand_ctx = { pool, r, cfg, variables ? variables : apr_hash_make(pool),
+                                          NULL, { { 0, 0 } } };
 
-        // Use callback-based replacement - works with variables!
-        char *result = ac_replace_with_callback(
+        // Use callback-based replacement - works with variables and regexes!
+        char *result = ac_replace_prefix_with_span_callback(
             cfg->automaton,
             input,
-            strlen(input),
-            expand_replacement_callback,  // Our callback to expand variables
-            r,                             // Request context for variable expansion
+            input_len,
+            scan_len,
+            expand_regex_callback,  // Our callback to confirm regexes and expand variables
+            &expand_ctx,            // Request, scopes and resolved variables
             &result_len
         );
         apr_time_t ac_end = apr_time_now();
@@ -308,38 +2648,425 @@ static char *perform_replacements(apr_pool_t *pool, const char *input, apr_hash_
 #ifndef TEST_BUILD
             if (r) {
                 ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                              "mod_replace: ac_replace_with_callback failed");
+                              "mod_replace: ac_replace_prefix_with_span_callback failed");
             }
 #endif
-            return apr_pstrdup(pool, input);
+            return (char *)input;
+        }
+
+        // Copy result to APR pool memory; the body may contain NUL bytes
+        char *pool_result = apr_palloc(pool, result_len + 1);
+        memcpy(pool_result, result, result_len);
+        pool_result[result_len] = '\0';
+        free(result);
+        *out_len = result_len;
+
+        apr_time_t end_time = apr_time_now();
+#ifndef TEST_BUILD
+        if (r) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                          "mod_replace: Optimized path completed - ac_time=%d μs, total_time=%d μs, "
+                          "input_len=%zu, output_len=%zu, patterns=%zu",
+                          (int)(ac_end - ac_start), (int)(end_time - start_time),
+                          input_len, result_len, pattern_count);
+        }
+#endif
+
+        return pool_result;
+    }
+
+    // Fallback if automaton not available (shouldn't happen in normal operation)
+#ifndef TEST_BUILD
+    if (r) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                      "mod_replace: Automaton not available, returning input unchanged");
+    }
+#endif
+    return (char *)input;
+}
+
+/*
+ * Output cache for static files. Once no rule references a variable, the
+ * rewritten body only depends on the source file and on the rule set, so it
+ * is stored under ReplaceCacheDir as "<rules digest>-<device>-<inode>" and
+ * hits are served back as a file bucket (sendfile when EnableSendfile allows
+ * it). Each entry starts with a header holding the size and mtime of the
+ * source it was rewritten from, checked on every hit, and the source path;
+ * an edited file overwrites its entry on the next miss.
+ *
+ * Entries that can no longer be hit are purged when the configuration is
+ * loaded (rule sets that are gone, sources that changed, were replaced or
+ * removed, interrupted stores) and when a reload replaces a rule set.
+ */
+#define REPLACE_CACHE_FINFO (APR_FINFO_IDENT | APR_FINFO_SIZE | APR_FINFO_MTIME)
+#define REPLACE_CACHE_MAGIC 0x3143524du        // "MRC1" in memory order on little-endian hosts
+#define REPLACE_CACHE_MAX_HEADER 8192
+#define REPLACE_CACHE_DIGEST_LEN (2 * APR_SHA1_DIGESTSIZE)
+#define REPLACE_CACHE_TEMP_AGE apr_time_from_sec(3600)
+
+typedef struct {
+    apr_uint32_t magic;
+    apr_uint32_t header_len;   // This header and the NUL-terminated source path, padded; the body follows
+    apr_uint64_t size;         // Source file when the entry was written
+    apr_uint64_t mtime;
+} replace_cache_header;
+
+/* Read the header of an open entry; 0 if it is not a valid one */
+static int replace_cache_read_header(apr_file_t *file, replace_cache_header *header)
+{
+    apr_size_t len = sizeof(replace_cache_header);
+
+    return apr_file_read_full(file, header, len, &len) == APR_SUCCESS
+        && header->magic == REPLACE_CACHE_MAGIC
+        && header->header_len > sizeof(replace_cache_header)
+        && header->header_len <= REPLACE_CACHE_MAX_HEADER;
+}
+
+static const char *replace_cache_name(apr_pool_t *pool, const char *digest, const apr_finfo_t *source)
+{
+    return apr_psprintf(pool, "%s-%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT, digest,
+                        (apr_uint64_t)source->device, (apr_uint64_t)source->inode);
+}
+
+static void replace_cache_open(ap_filter_t *f, apr_bucket_brigade *bb,
+                               replace_config *cfg, replace_ctx *ctx)
+{
+    request_rec *r = f->r;
+    core_dir_config *core;
+    apr_int32_t flags = APR_FOPEN_READ | APR_FOPEN_BINARY;
+    replace_cache_header header;
+    apr_bucket *b;
+
+    if (!cfg->cache_dir || !cfg->rules_digest || cfg->dynamic_rules > 0 ||
+        r->finfo.filetype != APR_REG ||
+        (r->finfo.valid & REPLACE_CACHE_FINFO) != REPLACE_CACHE_FINFO) {
+        return;
+    }
+
+    // Only bodies sent straight from the file qualify: handlers that generate
+    // output from r->filename (CGI, PHP, ...) do not send file buckets
+    for (b = APR_BRIGADE_FIRST(bb);
+         b != APR_BRIGADE_SENTINEL(bb) && APR_BUCKET_IS_METADATA(b);
+         b = APR_BUCKET_NEXT(b)) {
+    }
+    if (b == APR_BRIGADE_SENTINEL(bb) || !APR_BUCKET_IS_FILE(b)) {
+        return;
+    }
+
+    ctx->cache_path = apr_pstrcat(r->pool, cfg->cache_dir, "/",
+                                  replace_cache_name(r->pool, cfg->rules_digest, &r->finfo), NULL);
+
+    core = ap_get_core_module_config(r->per_dir_config);
+    if (core->enable_sendfile == ENABLE_SENDFILE_ON) {
+        flags |= APR_FOPEN_SENDFILE_ENABLED;
+    }
+
+    ctx->cache_state = REPLACE_CACHE_STORE;
+    if (apr_file_open(&ctx->cache_file, ctx->cache_path, flags,
+                      APR_FPROT_OS_DEFAULT, r->pool) == APR_SUCCESS) {
+        if (replace_cache_read_header(ctx->cache_file, &header) &&
+            header.size == (apr_uint64_t)r->finfo.size &&
+            header.mtime == (apr_uint64_t)r->finfo.mtime) {
+            ctx->cache_state = REPLACE_CACHE_HIT;
+            ctx->cache_body = header.header_len;
+        } else {
+            apr_file_close(ctx->cache_file);
+            ctx->cache_file = NULL;
+        }
+    }
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "mod_replace: cache %s for %s",
+                  ctx->cache_state == REPLACE_CACHE_HIT ? "hit" : "miss", ctx->cache_path);
+}
+
+// Replace the response body with the cached entry; false if it is unusable
+static int replace_cache_serve(ap_filter_t *f, replace_ctx *ctx, apr_bucket_brigade *bb)
+{
+    apr_finfo_t finfo;
+
+    if (apr_file_info_get(&finfo, APR_FINFO_SIZE, ctx->cache_file) != APR_SUCCESS ||
+        finfo.size < ctx->cache_body) {
+        return 0;
+    }
+
+    apr_brigade_cleanup(ctx->bb);
+    apr_brigade_cleanup(bb);
+    if (finfo.size > ctx->cache_body) {
+        apr_brigade_insert_file(bb, ctx->cache_file, ctx->cache_body,
+                                finfo.size - ctx->cache_body, f->r->pool);
+    }
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(f->c->bucket_alloc));
+    return 1;
+}
+
+// Write through a temporary file so concurrent readers never see a partial entry
+static void replace_cache_store(request_rec *r, replace_ctx *ctx, const char *data, apr_size_t len)
+{
+    apr_size_t path_len = strlen(r->filename) + 1;
+    replace_cache_header header;
+    apr_file_t *tmp;
+    char *tmp_path = apr_pstrcat(r->pool, ctx->cache_path, ".XXXXXX", NULL);
+    char *head;
+    apr_status_t rv;
+
+    header.magic = REPLACE_CACHE_MAGIC;
+    header.header_len = (apr_uint32_t)APR_ALIGN_DEFAULT(sizeof(header) + path_len);
+    header.size = (apr_uint64_t)r->finfo.size;
+    header.mtime = (apr_uint64_t)r->finfo.mtime;
+    if (header.header_len > REPLACE_CACHE_MAX_HEADER) {
+        return;
+    }
+    head = apr_pcalloc(r->pool, header.header_len);
+    memcpy(head, &header, sizeof(header));
+    memcpy(head + sizeof(header), r->filename, path_len);
+
+    rv = apr_file_mktemp(&tmp, tmp_path,
+                         APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL | APR_FOPEN_BINARY,
+                         r->pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                      "mod_replace: cannot create cache entry in %s", tmp_path);
+        return;
+    }
+
+    rv = apr_file_write_full(tmp, head, header.header_len, NULL);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(tmp, data, len, NULL);
+    }
+    if (apr_file_close(tmp) != APR_SUCCESS && rv == APR_SUCCESS) {
+        rv = APR_EGENERAL;
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_rename(tmp_path, ctx->cache_path, r->pool);
+    }
+    if (rv != APR_SUCCESS) {
+        apr_file_remove(tmp_path, r->pool);
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                      "mod_replace: cannot store cache entry %s", ctx->cache_path);
+    }
+}
+
+/* Is the entry a rewrite of its source file as the file is now? */
+static int replace_cache_entry_current(apr_pool_t *pool, const char *path, const char *name)
+{
+    replace_cache_header header;
+    apr_finfo_t source;
+    apr_file_t *file;
+    apr_size_t len;
+    char *source_path;
+    int current = 0;
+
+    if (apr_file_open(&file, path, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT,
+                      pool) != APR_SUCCESS) {
+        return 0;
+    }
+    if (replace_cache_read_header(file, &header)) {
+        len = header.header_len - sizeof(header);
+        source_path = apr_palloc(pool, len);
+        if (apr_file_read_full(file, source_path, len, &len) == APR_SUCCESS &&
+            memchr(source_path, '\0', len) &&
+            apr_stat(&source, source_path, REPLACE_CACHE_FINFO | APR_FINFO_TYPE, pool) == APR_SUCCESS &&
+            source.filetype == APR_REG &&
+            header.size == (apr_uint64_t)source.size && header.mtime == (apr_uint64_t)source.mtime) {
+            // The digest is the first part of the name; device and inode the rest
+            current = strcmp(name + REPLACE_CACHE_DIGEST_LEN,
+                             replace_cache_name(pool, "", &source)) == 0;
+        }
+    }
+    apr_file_close(file);
+    return current;
+}
+
+/*
+ * Remove the entries of dir that can no longer be hit. With stale_digest,
+ * those of that rule set; otherwise those of rule sets missing from digests,
+ * those whose source file changed or is gone, and temporary files of stores
+ * interrupted long ago. Files not named like entries are left alone.
+ */
+static void replace_cache_purge(apr_pool_t *pool, server_rec *s, const char *dir,
+                                apr_hash_t *digests, const char *stale_digest)
+{
+    apr_pool_t *scratch;
+    apr_dir_t *handle;
+    apr_finfo_t finfo;
+    apr_time_t now = apr_time_now();
+    apr_status_t rv;
+    int removed = 0, kept = 0;
+
+    if (apr_pool_create(&scratch, pool) != APR_SUCCESS) {
+        return;
+    }
+    if (apr_dir_open(&handle, dir, scratch) != APR_SUCCESS) {
+        apr_pool_destroy(scratch);
+        return;
+    }
+    while ((rv = apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_MTIME, handle))
+           == APR_SUCCESS || rv == APR_INCOMPLETE) {
+        const char *name = finfo.name;
+        const char *path;
+        int stale, i;
+
+        if ((finfo.valid & (APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_MTIME)) !=
+                (APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_MTIME) ||
+            strlen(name) <= REPLACE_CACHE_DIGEST_LEN || name[REPLACE_CACHE_DIGEST_LEN] != '-' ||
+            finfo.filetype != APR_REG) {
+            continue;
+        }
+        for (i = 0; i < REPLACE_CACHE_DIGEST_LEN && apr_isxdigit(name[i]); i++) {
+        }
+        if (i < REPLACE_CACHE_DIGEST_LEN) {
+            continue;
+        }
+
+        path = apr_pstrcat(scratch, dir, "/", name, NULL);
+        if (stale_digest) {
+            stale = strncmp(name, stale_digest, REPLACE_CACHE_DIGEST_LEN) == 0;
+        } else if (strchr(name, '.')) {
+            stale = now - finfo.mtime > REPLACE_CACHE_TEMP_AGE;
+        } else {
+            stale = !apr_hash_get(digests, name, REPLACE_CACHE_DIGEST_LEN)
+                 || !replace_cache_entry_current(scratch, path, name);
+        }
+        if (stale && apr_file_remove(path, scratch) == APR_SUCCESS) {
+            removed++;
+        } else {
+            kept++;
+        }
+    }
+    apr_dir_close(handle);
+    apr_pool_destroy(scratch);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "mod_replace: Purged %d stale entries from %s, %d kept", removed, dir, kept);
+}
+
+/* Offset just past the first terminator in data, ignoring ASCII case; 0 if there is none */
+static apr_size_t find_terminator(const char *data, apr_size_t len, const char *term, apr_size_t term_len)
+{
+    apr_size_t i, j;
+
+    for (i = 0; i + term_len <= len; i++) {
+        for (j = 0; j < term_len && apr_tolower(data[i + j]) == apr_tolower(term[j]); j++) {
+        }
+        if (j == term_len) {
+            return i + term_len;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Where the collected part of the body ends within a data bucket, for
+ * ReplaceScanLimit: the scanned prefix, up to the byte limit or past the
+ * terminator, and the byte after it, which tells whether a match ending
+ * at the limit ends at a word boundary. *cut is the offset just past that
+ * byte, and *reached tells whether it is in this bucket; a prefix ending
+ * with a bucket waits for the next one, or for the end of the body. Only
+ * buckets with a terminator to look for, or of unknown length, are read.
+ */
+static apr_status_t scan_limit_cut(replace_ctx *ctx, apr_bucket *b, apr_size_t *cut, int *reached)
+{
+    const replace_config *cfg = ctx->cfg;
+    const char *data = NULL;
+    apr_size_t len = b->length;
+    apr_status_t rv;
+
+    if (cfg->scan_terminator || len == (apr_size_t)-1) {
+        rv = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+    *cut = len;
+    *reached = 0;
+    if (ctx->scan_end) {
+        // The prefix ended with an earlier bucket; this one holds the byte after it
+        *cut = len > 0 ? 1 : 0;
+        *reached = len > 0;
+        return APR_SUCCESS;
+    }
+    if (cfg->scan_limit > 0 && (apr_off_t)len >= cfg->scan_limit - ctx->scanned) {
+        *cut = (apr_size_t)(cfg->scan_limit - ctx->scanned);
+        *reached = 1;
+    }
+
+    if (cfg->scan_terminator && len > 0) {
+        apr_size_t term_len = strlen(cfg->scan_terminator);
+        apr_size_t head = len < term_len - 1 ? len : term_len - 1;
+        apr_size_t found;
+
+        if (!ctx->carry) {
+            ctx->carry = apr_palloc(ctx->pool, term_len);
+            ctx->joined = apr_palloc(ctx->pool, 2 * term_len);
+        }
+
+        // A terminator starting in earlier buckets, then one within this bucket
+        memcpy(ctx->joined, ctx->carry, ctx->carry_len);
+        memcpy(ctx->joined + ctx->carry_len, data, head);
+        found = find_terminator(ctx->joined, ctx->carry_len + head, cfg->scan_terminator, term_len);
+        if (found) {
+            found -= ctx->carry_len;
+        } else {
+            found = find_terminator(data, len, cfg->scan_terminator, term_len);
+        }
+        if (found && found <= *cut) {
+            *cut = found;
+            *reached = 1;
         }
 
-        // Copy result to APR pool memory
-        char *pool_result = apr_pstrndup(pool, result, result_len);
-        free(result);
-
-        apr_time_t end_time = apr_time_now();
-#ifndef TEST_BUILD
-        if (r) {
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                          "mod_replace: Optimized path completed - ac_time=%d μs, total_time=%d μs, "
-                          "input_len=%zu, output_len=%zu, patterns=%zu",
-                          (int)(ac_end - ac_start), (int)(end_time - start_time),
-                          input_len, result_len, pattern_count);
+        // Keep the last term_len - 1 bytes seen for the next bucket
+        if (len >= term_len - 1) {
+            ctx->carry_len = term_len - 1;
+            memcpy(ctx->carry, data + len - ctx->carry_len, ctx->carry_len);
+        } else {
+            apr_size_t keep = ctx->carry_len + len > term_len - 1 ? term_len - 1 - len : ctx->carry_len;
+            memmove(ctx->carry, ctx->carry + ctx->carry_len - keep, keep);
+            memcpy(ctx->carry + keep, data, len);
+            ctx->carry_len = keep + len;
         }
-#endif
+    }
 
-        return pool_result ? pool_result : apr_pstrdup(pool, input);
+    if (*reached) {
+        ctx->scan_end = ctx->scanned + (apr_off_t)*cut;
+        if (*cut < len) {
+            (*cut)++;
+        } else {
+            *reached = 0;
+        }
     }
+    return APR_SUCCESS;
+}
 
-    // Fallback if automaton not available (shouldn't happen in normal operation)
-#ifndef TEST_BUILD
-    if (r) {
-        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
-                      "mod_replace: Automaton not available, returning input unchanged");
+/*
+ * Rewrite the collected body and put it in front of bb. Rewriting joins
+ * the collected data into one bucket, so metadata collected between data
+ * buckets, such as FLUSH, goes first, in its original order.
+ */
+static void replace_collected(ap_filter_t *f, replace_ctx *ctx, apr_bucket_brigade *bb)
+{
+    apr_bucket *first = APR_BRIGADE_FIRST(bb);
+    apr_bucket *b, *next_b;
+    char *data;
+    apr_size_t len;
+    apr_status_t rv = apr_brigade_pflatten(ctx->bb, &data, &len, ctx->pool);
+
+    for (b = APR_BRIGADE_FIRST(ctx->bb); b != APR_BRIGADE_SENTINEL(ctx->bb); b = next_b) {
+        next_b = APR_BUCKET_NEXT(b);
+        if (APR_BUCKET_IS_METADATA(b)) {
+            APR_BUCKET_REMOVE(b);
+            APR_BUCKET_INSERT_BEFORE(first, b);
+        }
+    }
+    apr_brigade_cleanup(ctx->bb);
+    if (rv == APR_SUCCESS && data && len > 0) {
+        // Without the byte after the prefix, the body ended with it
+        apr_size_t scan_len = ctx->scan_end && (apr_size_t)ctx->scan_end < len ?
+                              (apr_size_t)ctx->scan_end : len;
+        apr_size_t processed_len;
+        char *processed = perform_replacements(ctx->pool, data, len, scan_len, ctx->cfg, f->r,
+                                               ctx->variables, &processed_len);
+        APR_BUCKET_INSERT_BEFORE(first, apr_bucket_pool_create(processed, processed_len,
+                                                               ctx->pool, f->c->bucket_alloc));
     }
-#endif
-    return apr_pstrdup(pool, input);
 }
 
 static apr_status_t replace_output_filter(ap_filter_t *f, apr_bucket_brigade *bb)
@@ -363,7 +3090,7 @@ static apr_status_t replace_output_filter(ap_filter_t *f, apr_bucket_brigade *bb
                   cfg ? cfg->enabled : -1, 
                   cfg ? apr_hash_count(cfg->replacements) : -1);
     
-    if (!cfg || !cfg->enabled || apr_hash_count(cfg->replacements) == 0) {
+    if (!cfg || !cfg->enabled || (!cfg->live && apr_hash_count(cfg->replacements) == 0)) {
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r, "mod_replace: passing brigade through");
         return ap_pass_brigade(f->next, bb);
     }
@@ -381,9 +3108,6 @@ static apr_status_t replace_output_filter(ap_filter_t *f, apr_bucket_brigade *bb
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r, 
                   "mod_replace: processing content type: %s", content_type ? content_type : "unknown");
     
-    // Ensure automaton is compiled
-    ensure_automaton_compiled(cfg);
-    
     ctx = f->ctx;
     if (!ctx) {
         ctx = apr_pcalloc(f->r->pool, sizeof(replace_ctx));
@@ -395,7 +3119,19 @@ static apr_status_t replace_output_filter(ap_filter_t *f, apr_bucket_brigade *bb
             return ap_pass_brigade(f->next, bb);
         }
         ctx->pool = f->r->pool;
+        ctx->cfg = current_config(cfg, f->r->pool, NULL);
+        ctx->variables = apr_hash_make(f->r->pool);
         f->ctx = ctx;
+        if (config_scan_limited(ctx->cfg)) {
+            // The rewritten head and the untouched rest may go out in separate passes
+            apr_table_unset(f->r->headers_out, "Content-Length");
+        } else {
+            replace_cache_open(f, bb, ctx->cfg, ctx);
+        }
+    }
+
+    if (ctx->passthrough) {
+        return ap_pass_brigade(f->next, bb);
     }
     
     for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = next_b) {
@@ -406,30 +3142,77 @@ static apr_status_t replace_output_filter(ap_filter_t *f, apr_bucket_brigade *bb
             break;
         }
         
+        // Metadata stays in order with the body collected around it
         if (APR_BUCKET_IS_METADATA(b)) {
+            if (config_scan_limited(ctx->cfg)) {
+                APR_BUCKET_REMOVE(b);
+                APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
+            }
             continue;
         }
+
+        // Past the scan limit, the rest of the body, from the split point
+        // on, is passed down as it came, without reading or copying it
+        if (config_scan_limited(ctx->cfg)) {
+            apr_size_t cut;
+            int reached;
+
+            rv = scan_limit_cut(ctx, b, &cut, &reached);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            next_b = APR_BUCKET_NEXT(b);  // Reading may have split off the unread part
+            if (reached) {
+                if (cut > 0) {
+                    if (cut < b->length) {
+                        apr_bucket_split(b, cut);
+                    }
+                    APR_BUCKET_REMOVE(b);
+                    APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
+                }
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r,
+                              "mod_replace: scan limit reached after %" APR_OFF_T_FMT " bytes",
+                              ctx->scan_end);
+                replace_collected(f, ctx, bb);
+                ctx->passthrough = 1;
+                return ap_pass_brigade(f->next, bb);
+            }
+            ctx->scanned += (apr_off_t)b->length;
+        }
         
         APR_BUCKET_REMOVE(b);
         APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
     }
     
     if (eos_found) {
+        if (ctx->cache_state == REPLACE_CACHE_HIT && replace_cache_serve(f, ctx, bb)) {
+            return ap_pass_brigade(f->next, bb);
+        }
+        if (config_scan_limited(ctx->cfg)) {
+            // Body ended within the limit; bb starts at the EOS
+            replace_collected(f, ctx, bb);
+            return ap_pass_brigade(f->next, bb);
+        }
         if (!APR_BRIGADE_EMPTY(ctx->bb)) {
             char *data;
             apr_size_t len;
             
+            // The flattened body is not NUL-terminated and may contain NUL
+            // bytes, so its length travels with it, into the cache as well
             rv = apr_brigade_pflatten(ctx->bb, &data, &len, ctx->pool);
             if (rv == APR_SUCCESS && data && len > 0) {
-                char *processed = perform_replacements(ctx->pool, data, cfg->replacements, f->r);
-                if (processed) {
-                    apr_bucket *data_bucket = apr_bucket_pool_create(processed, strlen(processed), 
-                                                                   ctx->pool, f->c->bucket_alloc);
-                    if (data_bucket) {
-                        apr_brigade_cleanup(bb);
-                        APR_BRIGADE_INSERT_TAIL(bb, data_bucket);
-                        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(f->c->bucket_alloc));
-                    }
+                apr_size_t processed_len;
+                char *processed = perform_replacements(ctx->pool, data, len, len, ctx->cfg, f->r,
+                                                       ctx->variables, &processed_len);
+                if (ctx->cache_state == REPLACE_CACHE_STORE) {
+                    replace_cache_store(f->r, ctx, processed, processed_len);
+                }
+                apr_bucket *data_bucket = apr_bucket_pool_create(processed, processed_len,
+                                                               ctx->pool, f->c->bucket_alloc);
+                if (data_bucket) {
+                    apr_brigade_cleanup(bb);
+                    APR_BRIGADE_INSERT_TAIL(bb, data_bucket);
+                    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(f->c->bucket_alloc));
                 }
             }
         }
@@ -448,24 +3231,660 @@ static void insert_replace_filter(request_rec *r)
                   cfg ? cfg->enabled : -1, 
                   cfg ? apr_hash_count(cfg->replacements) : -1);
     
-    if (cfg->enabled && apr_hash_count(cfg->replacements) > 0) {
+    if (cfg->enabled && (cfg->live || apr_hash_count(cfg->replacements) > 0)) {
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "mod_replace: Adding REPLACE filter");
         ap_add_output_filter("REPLACE", NULL, r, r->connection);
+
+        // Headers may reference the nonce before the body is rewritten; only
+        // the rules this request's location has right now count
+        if (current_config(cfg, r->pool, NULL)->nonce_rules > 0) {
+            provide_csp_nonce(r);
+        }
     }
 }
 
 static const command_rec replace_cmds[] = {
-    AP_INIT_TAKE2("ReplaceRule", set_replace_rule, NULL, ACCESS_CONF | RSRC_CONF,
-                  "Define a replacement rule: ReplaceRule <search> <replace>"),
+    AP_INIT_TAKE_ARGV("ReplaceRule", set_replace_rule, NULL, ACCESS_CONF | RSRC_CONF,
+                      "Define a replacement rule: ReplaceRule <search> <replace> [boundaries] [context=...]"),
+    AP_INIT_TAKE2("ReplaceRegex", set_replace_regex, NULL, ACCESS_CONF | RSRC_CONF,
+                  "Define a regex replacement rule: ReplaceRegex <regex> <replace>"),
     AP_INIT_FLAG("ReplaceEnable", set_replace_enable, NULL, ACCESS_CONF | RSRC_CONF,
                  "Enable or disable text replacement"),
+    AP_INIT_TAKE1("ReplaceRuleFile", set_replace_rule_file, NULL, ACCESS_CONF | RSRC_CONF,
+                  "Load search|replace rules, one per line: ReplaceRuleFile <file>"),
+    AP_INIT_TAKE1("ReplaceRuleImage", set_replace_rule_image, NULL, ACCESS_CONF | RSRC_CONF,
+                  "Load rules precompiled by replace_compile: ReplaceRuleImage <file>"),
+    AP_INIT_FLAG("ReplaceCaseInsensitive", set_replace_case_insensitive, NULL, ACCESS_CONF | RSRC_CONF,
+                 "Match search strings regardless of ASCII letter case"),
+    AP_INIT_TAKE1("ReplaceReloadInterval", set_replace_reload_interval, NULL, RSRC_CONF,
+                  "Seconds between checks of ReplaceRuleFile files for changes (0 = never)"),
+    AP_INIT_TAKE12("ReplaceScanLimit", set_replace_scan_limit, NULL, ACCESS_CONF | RSRC_CONF,
+                   "Rewrite only the start of bodies: ReplaceScanLimit <bytes>|<terminator>|off"),
+    AP_INIT_TAKE1("ReplaceCacheDir", set_replace_cache_dir, NULL, ACCESS_CONF | RSRC_CONF,
+                  "Directory for cached rewritten static files: ReplaceCacheDir <path>"),
     { NULL }
 };
 
 #ifndef TEST_BUILD
+static int replace_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    pending_configs = apr_array_make(pconf, 16, sizeof(replace_config *));
+
+    memset(&merge_cache, 0, sizeof(merge_cache));
+    merge_cache.pool = pconf;
+    merge_cache.automata = apr_hash_make(pconf);
+
+    memset(&scoped, 0, sizeof(scoped));
+
+    memset(&reload, 0, sizeof(reload));
+    reload.pool = pconf;
+    reload.lives = apr_array_make(pconf, 4, sizeof(replace_live *));
+    reload.files = apr_hash_make(pconf);
+    return OK;
+}
+
+/*
+ * Move the search images of the startup automata into one anonymous shared
+ * mapping created before the MPM forks, then make it read-only. Children
+ * search the parent's pages directly instead of each holding a private copy
+ * of every rule set. Automata built later (per-request merges) stay private.
+ */
+static void share_automaton_images(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s)
+{
+#if APR_HAS_SHARED_MEMORY
+    apr_hash_t *seen = apr_hash_make(ptemp);
+    apr_array_header_t *automata = apr_array_make(ptemp, 8, sizeof(ac_automaton_t *));
+    apr_size_t total = 0, page = 4096, usable;
+    apr_shm_t *shm;
+    apr_status_t rv;
+    char *base, *start;
+    int i;
+
+    for (i = 0; i < pending_configs->nelts; i++) {
+        ac_automaton_t *ac = APR_ARRAY_IDX(pending_configs, i, replace_config *)->automaton;
+
+        // Images mapped from a rule image file are shared through the page cache already
+        if (!ac || !ac->is_compiled || !ac->owns_image || ac->mapped_size
+            || apr_hash_get(seen, &ac, sizeof(ac))) {
+            continue;
+        }
+        apr_hash_set(seen, apr_pmemdup(ptemp, &ac, sizeof(ac)), sizeof(ac), ac);
+        APR_ARRAY_PUSH(automata, ac_automaton_t *) = ac;
+        total += APR_ALIGN_DEFAULT(ac_image_size(ac));
+    }
+    if (automata->nelts == 0) {
+        return;
+    }
+
+#ifndef WIN32
+    page = (apr_size_t)sysconf(_SC_PAGESIZE);
+#endif
+    // The segment header precedes the usable area, so reserve one extra page
+    // to start the images on a page boundary that can be write-protected
+    rv = apr_shm_create(&shm, APR_ALIGN(total, page) + page, NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                     "mod_replace: Cannot create shared memory for %d compiled automata, "
+                     "each process keeps its own copy", automata->nelts);
+        return;
+    }
+    base = apr_shm_baseaddr_get(shm);
+    start = (char *)APR_ALIGN((apr_uintptr_t)base, page);
+    usable = apr_shm_size_get(shm) - (apr_size_t)(start - base);
+
+    total = 0;
+    for (i = 0; i < automata->nelts; i++) {
+        ac_automaton_t *ac = APR_ARRAY_IDX(automata, i, ac_automaton_t *);
+        apr_size_t size = ac_image_size(ac);
+
+        if (!ac_relocate_image(ac, start + total, usable - total)) {
+            continue;
+        }
+        total += APR_ALIGN_DEFAULT(size);
+    }
+
+#ifndef WIN32
+    if (mprotect(start, APR_ALIGN(total, page), PROT_READ) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, errno, s,
+                     "mod_replace: Cannot write-protect shared automata");
+    }
+#endif
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "mod_replace: Shared %d compiled automata (%" APR_SIZE_T_FMT " bytes) "
+                 "read-only across processes", automata->nelts, total);
+#endif
+}
+
+/* Is the variant the rule's replacement in each of the scope_count scopes? */
+static int scoped_everywhere(const replace_scoped_variant *variant, int scope_count)
+{
+    int i;
+
+    for (i = 0; i < scope_count; i++) {
+        if (!(variant->mask[i / 64] & (APR_UINT64_C(1) << (i % 64)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Give every eligible startup rule set a scope in one shared automaton; see the scoped struct */
+static void build_scoped_automaton(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s)
+{
+    apr_array_header_t *configs = apr_array_make(ptemp, 8, sizeof(replace_config *));
+    apr_hash_t *rules = apr_hash_make(ptemp);  // search -> apr_array_header_t of replace_scoped_variant
+    apr_time_t start = apr_time_now();
+    apr_hash_index_t *hi;
+    ac_automaton_t *automaton;
+    int i, words, variant_count = 0;
+
+    for (i = 0; i < pending_configs->nelts; i++) {
+        replace_config *config = APR_ARRAY_IDX(pending_configs, i, replace_config *);
+        if (scope_eligible(config)) {
+            APR_ARRAY_PUSH(configs, replace_config *) = config;
+        }
+    }
+    // A single rule set gains nothing from scopes
+    if (configs->nelts < 2) {
+        return;
+    }
+
+    words = (configs->nelts + 63) / 64;
+    for (i = 0; i < configs->nelts; i++) {
+        replace_config *config = APR_ARRAY_IDX(configs, i, replace_config *);
+
+        for (hi = apr_hash_first(ptemp, config->replacements); hi; hi = apr_hash_next(hi)) {
+            const char *search = NULL;
+            const replace_rule *rule = NULL;
+            replace_scoped_variant *variant = NULL;
+            apr_array_header_t *variants;
+            int v;
+            apr_hash_this(hi, (const void **)&search, NULL, (void **)&rule);
+
+            variants = apr_hash_get(rules, search, APR_HASH_KEY_STRING);
+            if (!variants) {
+                variants = apr_array_make(ptemp, 1, sizeof(replace_scoped_variant));
+                apr_hash_set(rules, search, APR_HASH_KEY_STRING, variants);
+            }
+            for (v = 0; v < variants->nelts && !variant; v++) {
+                replace_scoped_variant *candidate = &APR_ARRAY_IDX(variants, v, replace_scoped_variant);
+                if (strcmp(candidate->tmpl->replacement_template, rule->replacement) == 0) {
+                    variant = candidate;
+                }
+            }
+            if (!variant) {
+                variant = apr_array_push(variants);
+                variant->tmpl = compile_template(pconf, rule->replacement, 0);
+                variant->mask = apr_pcalloc(pconf, words * sizeof(apr_uint64_t));
+                variant_count++;
+            }
+            variant->mask[i / 64] |= APR_UINT64_C(1) << (i % 64);
+        }
+    }
+
+    automaton = ac_create(0);
+    if (!automaton) {
+        return;
+    }
+    apr_pool_cleanup_register(pconf, automaton, cleanup_automaton, apr_pool_cleanup_null);
+    for (hi = apr_hash_first(ptemp, rules); hi; hi = apr_hash_next(hi)) {
+        const char *search = NULL;
+        apr_array_header_t *variants = NULL;
+        replace_scoped_rule *rule = apr_palloc(pconf, sizeof(replace_scoped_rule));
+        apr_hash_this(hi, (const void **)&search, NULL, (void **)&variants);
+
+        rule->count = variants->nelts;
+        rule->variants = apr_pmemdup(pconf, variants->elts,
+                                     variants->nelts * sizeof(replace_scoped_variant));
+
+        // A static rule every scope shares needs no scope lookup either
+        if (rule->count == 1 && scoped_everywhere(rule->variants, configs->nelts) &&
+            !replacement_has_variable(rule->variants[0].tmpl->replacement_template)) {
+            const char *replace_val = rule->variants[0].tmpl->replacement_template;
+            if (!ac_add_pattern_ex(automaton, search, strlen(search),
+                                   replace_val, strlen(replace_val), NULL)) {
+                return;
+            }
+            continue;
+        }
+        if (!ac_add_pattern_ex(automaton, search, strlen(search), NULL, 0, rule)) {
+            return;
+        }
+    }
+    if (!ac_compile(automaton)) {
+        return;
+    }
+
+    for (i = 0; i < configs->nelts; i++) {
+        replace_config *config = APR_ARRAY_IDX(configs, i, replace_config *);
+        int *scope = apr_palloc(pconf, sizeof(int));
+
+        *scope = i;
+        config->scopes = scope;
+        config->scope_count = 1;
+        config->automaton = automaton;
+        config->automaton_compiled = 1;
+    }
+    scoped.automaton = automaton;
+    scoped.scope_count = configs->nelts;
+    scoped.build_time = apr_time_now() - start;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "mod_replace: Built one scoped automaton for %d rule sets - patterns=%u, "
+                 "replacements=%d, build_time=%d μs",
+                 configs->nelts, apr_hash_count(rules), variant_count,
+                 (int)(apr_time_now() - start));
+}
+
+/*
+ * Startup report. For capacity planning, every distinct automaton is logged
+ * at info level with its size by structure, how it is laid out and what it
+ * cost to build, so oversized rule sets show up before RSS alarms do. Only
+ * figures already known are logged; replace_compile measures throughput.
+ */
+typedef struct {
+    ac_automaton_t *automaton;
+    int rule_sets;                      // Configs using it
+    apr_interval_time_t compile_time;   // 0 for loaded images
+} replace_rule_set_report;
+
+/* Record the automaton of a startup config, timed by its first user */
+static void note_rule_set(apr_pool_t *ptemp, apr_hash_t *reports, apr_array_header_t *order,
+                          replace_config *config, apr_interval_time_t compile_time)
+{
+    replace_rule_set_report *report;
+
+    if (!config->automaton || !config->automaton_compiled) {
+        return;
+    }
+    report = apr_hash_get(reports, &config->automaton, sizeof(ac_automaton_t *));
+    if (!report) {
+        report = apr_pcalloc(ptemp, sizeof(replace_rule_set_report));
+        report->automaton = config->automaton;
+        report->compile_time = config->automaton == scoped.automaton ? scoped.build_time : compile_time;
+        apr_hash_set(reports, &report->automaton, sizeof(ac_automaton_t *), report);
+        APR_ARRAY_PUSH(order, replace_rule_set_report *) = report;
+    }
+    report->rule_sets++;
+}
+
+static void report_rule_sets(server_rec *s, apr_array_header_t *order)
+{
+    int i;
+
+    for (i = 0; i < order->nelts; i++) {
+        replace_rule_set_report *report = APR_ARRAY_IDX(order, i, replace_rule_set_report *);
+        const ac_automaton_t *ac = report->automaton;
+        ac_memory_stats_t stats;
+        const char *layout;
+
+        ac_get_memory_stats(ac, &stats);
+        if (stats.image_bytes == 0) {
+            continue;
+        }
+        layout = ac->mapped_size ? "mapped from a rule image"
+               : ac->owns_image ? "private" : "shared read-only";
+
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                     "mod_replace: Rule set %d/%d - used_by=%d configs, engine=%s DFA (%zu byte classes, %s), "
+                     "patterns=%zu, states=%zu, transitions=%zu bytes, outputs=%zu bytes, strings=%zu bytes, "
+                     "image=%zu bytes, trie=%zu bytes, compile_time=%d μs",
+                     i + 1, order->nelts, report->rule_sets,
+                     ac == scoped.automaton ? "scoped" : "flat", stats.class_count, layout,
+                     stats.pattern_count, stats.state_count, stats.transition_bytes, stats.output_bytes,
+                     stats.string_bytes, stats.image_bytes, stats.trie_bytes, (int)report->compile_time);
+    }
+}
+
+/* Purge every cache directory of the entries the rule sets just loaded cannot hit */
+static void purge_cache_dirs(apr_pool_t *ptemp, server_rec *s)
+{
+    apr_hash_t *dirs = apr_hash_make(ptemp);  // cache_dir -> apr_hash_t of live digests
+    apr_hash_index_t *hi;
+    int i;
+
+    for (i = 0; i < pending_configs->nelts; i++) {
+        replace_config *config = APR_ARRAY_IDX(pending_configs, i, replace_config *);
+        apr_hash_t *digests;
+
+        if (!config->cache_dir) {
+            continue;
+        }
+        digests = apr_hash_get(dirs, config->cache_dir, APR_HASH_KEY_STRING);
+        if (!digests) {
+            digests = apr_hash_make(ptemp);
+            apr_hash_set(dirs, config->cache_dir, APR_HASH_KEY_STRING, digests);
+        }
+        if (config->rules_digest) {
+            apr_hash_set(digests, config->rules_digest, REPLACE_CACHE_DIGEST_LEN, config);
+        }
+    }
+    for (hi = apr_hash_first(ptemp, dirs); hi; hi = apr_hash_next(hi)) {
+        const char *dir = NULL;
+        apr_hash_t *digests = NULL;
+        apr_hash_this(hi, (const void **)&dir, NULL, (void **)&digests);
+        replace_cache_purge(ptemp, s, dir, digests, NULL);
+    }
+}
+
+static int replace_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+    apr_time_t start = apr_time_now();
+    apr_hash_t *reports = apr_hash_make(ptemp);
+    apr_array_header_t *order = apr_array_make(ptemp, 8, sizeof(replace_rule_set_report *));
+    int i;
+
+    replace_is_https = APR_RETRIEVE_OPTIONAL_FN(ssl_is_https);
+    build_scoped_automaton(pconf, ptemp, s);
+
+    for (i = 0; i < pending_configs->nelts; i++) {
+        replace_config *config = APR_ARRAY_IDX(pending_configs, i, replace_config *);
+        apr_time_t compile_start = apr_time_now();
+
+        compile_config_automaton(config);
+        if (apr_hash_count(config->replacements) > 0 && !config->automaton_compiled) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "mod_replace: cannot compile a rule set of %u rules",
+                         apr_hash_count(config->replacements));
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        note_rule_set(ptemp, reports, order, config, apr_time_now() - compile_start);
+        digest_config_rules(pconf, config);
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "mod_replace: Compiled %d distinct automata for %d rule sets at startup in %d μs",
+                 order->nelts, pending_configs->nelts, (int)(apr_time_now() - start));
+
+    if (reload.interval > 0) {
+        for (i = 0; i < pending_configs->nelts; i++) {
+            replace_config *config = APR_ARRAY_IDX(pending_configs, i, replace_config *);
+            if (config->has_rule_files) {
+                create_live(pconf, config, NULL, NULL);
+            }
+        }
+    }
+
+    share_automaton_images(pconf, ptemp, s);
+
+    // The first pass only checks the configuration
+    if (ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_CREATE_PRE_CONFIG) {
+        purge_cache_dirs(ptemp, s);
+        if (APLOG_IS_LEVEL(s, APLOG_INFO)) {
+            report_rule_sets(s, order);
+        }
+    }
+
+    // From now on configs are created per request and compiled by merge_replace_config
+    pending_configs = NULL;
+    return OK;
+}
+
+/* Replay the rule sources of a config into a new generation; runs on the watcher thread */
+static replace_generation *build_generation(replace_config *config, server_rec *s)
+{
+    apr_pool_t *pool;
+    replace_generation *gen;
+    apr_hash_index_t *hi;
+    int i;
+
+    // Generations outlive any request or child pool they could hang off
+    if (apr_pool_create_unmanaged(&pool) != APR_SUCCESS) {
+        return NULL;
+    }
+    gen = apr_pcalloc(pool, sizeof(replace_generation));
+    gen->pool = pool;
+    gen->replacements = apr_hash_make(pool);
+
+    for (i = 0; i < config->sources->nelts; i++) {
+        replace_rule_source *source = &APR_ARRAY_IDX(config->sources, i, replace_rule_source);
+
+        if (source->file) {
+            apr_finfo_t finfo;
+            apr_size_t arena_size;
+            int rule_count;
+            const char *error = read_rule_file(pool, source->file, add_rule_to_table,
+                                               gen->replacements, &finfo, &rule_count, &arena_size);
+            if (error) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                             "mod_replace: Reload failed, keeping the current rules: %s", error);
+                apr_pool_destroy(pool);
+                return NULL;
+            }
+        } else {
+            for (hi = apr_hash_first(pool, source->rules); hi; hi = apr_hash_next(hi)) {
+                const void *search;
+                apr_ssize_t search_len;
+                void *rule;
+                apr_hash_this(hi, &search, &search_len, &rule);
+                apr_hash_set(gen->replacements, search, search_len, rule);
+            }
+        }
+    }
+
+    for (hi = apr_hash_first(pool, gen->replacements); hi; hi = apr_hash_next(hi)) {
+        const char *search = NULL;
+        const replace_rule *rule = NULL;
+        apr_hash_this(hi, (const void **)&search, NULL, (void **)&rule);
+        gen->rules_fingerprint += rule_fingerprint(search, rule);
+        gen->dynamic_rules += replacement_has_variable(rule->replacement);
+        gen->nonce_rules += replacement_has_nonce(rule->replacement);
+    }
+    if (config->cache_dir && gen->dynamic_rules == 0 && apr_hash_count(gen->replacements) > 0) {
+        gen->rules_digest = rules_digest(pool, gen->replacements, config_nocase(config));
+    }
+
+    // Rule sets reloaded to the same rules (several vhosts including one
+    // file, or a file reverted to an earlier version) share one automaton
+    if (apr_hash_count(gen->replacements) > 0) {
+        gen->shared = acquire_shared_automaton(pool, gen->rules_fingerprint, gen->replacements,
+                                               config_nocase(config));
+        if (!gen->shared) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "mod_replace: Reload failed to compile rules, keeping the current rules");
+            apr_pool_destroy(pool);
+            return NULL;
+        }
+        gen->automaton = gen->shared->automaton;
+    }
+
+    gen->refs = 1;
+    return gen;
+}
+
+static int uses_changed_file(replace_config *config, apr_hash_t *changed)
+{
+    int i;
+
+    for (i = 0; i < config->sources->nelts; i++) {
+        replace_rule_source *source = &APR_ARRAY_IDX(config->sources, i, replace_rule_source);
+        if (source->file && apr_hash_get(changed, source->file, APR_HASH_KEY_STRING)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void reload_changed_rules(apr_pool_t *scratch, server_rec *s)
+{
+    apr_hash_t *changed = apr_hash_make(scratch);
+    apr_array_header_t *lives;
+    apr_hash_index_t *hi;
+    apr_time_t start;
+    int i, reloaded = 0;
+
+    for (hi = apr_hash_first(scratch, reload.files); hi; hi = apr_hash_next(hi)) {
+        replace_watched_file *file;
+        apr_finfo_t finfo;
+
+        apr_hash_this(hi, NULL, NULL, (void **)&file);
+        if (apr_stat(&finfo, file->path, APR_FINFO_MTIME | APR_FINFO_SIZE, scratch) != APR_SUCCESS) {
+            continue;
+        }
+        if (finfo.mtime == file->mtime && finfo.size == file->size) {
+            file->seen = 0;
+        } else if (file->seen && finfo.mtime == file->seen_mtime && finfo.size == file->seen_size) {
+            file->failed = 0;
+            apr_hash_set(changed, file->path, APR_HASH_KEY_STRING, file);
+        } else {
+            // Changed since the last poll: wait for it to settle
+            file->seen_mtime = finfo.mtime;
+            file->seen_size = finfo.size;
+            file->seen = 1;
+        }
+    }
+    if (apr_hash_count(changed) == 0) {
+        return;
+    }
+
+    start = apr_time_now();
+    reload_lock();
+    lives = apr_array_copy(scratch, reload.lives);
+    reload_unlock();
+
+    for (i = 0; i < lives->nelts; i++) {
+        replace_live *live = APR_ARRAY_IDX(lives, i, replace_live *);
+        replace_generation *gen, *old;
+
+        if (!uses_changed_file(live->config, changed)) {
+            continue;
+        }
+        gen = build_generation(live->config, s);
+        if (!gen) {
+            int j;
+            for (j = 0; j < live->config->sources->nelts; j++) {
+                replace_rule_source *source = &APR_ARRAY_IDX(live->config->sources, j, replace_rule_source);
+                replace_watched_file *file = source->file ?
+                    apr_hash_get(changed, source->file, APR_HASH_KEY_STRING) : NULL;
+                if (file) {
+                    file->failed = 1;
+                }
+            }
+            continue;
+        }
+
+        reload_lock();
+        old = apr_atomic_xchgptr((volatile void **)&live->current, gen);
+        reload_unlock();
+
+        // Cached output of the replaced rules can no longer be hit
+        if (live->config->cache_dir && old->rules_digest &&
+            (!gen->rules_digest || strcmp(old->rules_digest, gen->rules_digest) != 0)) {
+            replace_cache_purge(scratch, s, live->config->cache_dir, NULL, old->rules_digest);
+        }
+        release_generation(old);
+        reloaded++;
+    }
+
+    // Files every rule set was rebuilt from are in use now; the others are retried
+    for (hi = apr_hash_first(scratch, changed); hi; hi = apr_hash_next(hi)) {
+        replace_watched_file *file;
+        apr_hash_this(hi, NULL, NULL, (void **)&file);
+        if (!file->failed) {
+            file->mtime = file->seen_mtime;
+            file->size = file->seen_size;
+            file->seen = 0;
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                 "mod_replace: Reloaded %d rule sets after changes to %u files in %d ms",
+                 reloaded, apr_hash_count(changed), (int)((apr_time_now() - start) / 1000));
+}
+
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC reload_watcher(apr_thread_t *thread, void *data)
+{
+    server_rec *s = (server_rec *)data;
+    apr_pool_t *scratch;
+
+    if (apr_pool_create_unmanaged(&scratch) != APR_SUCCESS) {
+        apr_thread_exit(thread, APR_ENOMEM);
+        return NULL;
+    }
+
+    apr_thread_mutex_lock(reload.lock);
+    while (!reload.stopping) {
+        apr_thread_cond_timedwait(reload.wakeup, reload.lock, reload.interval);
+        if (reload.stopping) {
+            break;
+        }
+        apr_thread_mutex_unlock(reload.lock);
+        reload_changed_rules(scratch, s);
+        apr_pool_clear(scratch);
+        apr_thread_mutex_lock(reload.lock);
+    }
+    apr_thread_mutex_unlock(reload.lock);
+
+    apr_pool_destroy(scratch);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t stop_reload_watcher(void *data)
+{
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(reload.lock);
+    reload.stopping = 1;
+    apr_thread_cond_signal(reload.wakeup);
+    apr_thread_mutex_unlock(reload.lock);
+    apr_thread_join(&rv, reload.watcher);
+    return APR_SUCCESS;
+}
+#endif
+
+static void start_reload_watcher(apr_pool_t *pchild, server_rec *s)
+{
+#if APR_HAS_THREADS
+    apr_status_t rv;
+
+    // Memoized merges register new rule sets from request threads
+    apr_pool_create(&reload.pool, pchild);
+    reload.lives = apr_array_copy(reload.pool, reload.lives);
+
+    rv = apr_thread_mutex_create(&reload.lock, APR_THREAD_MUTEX_DEFAULT, pchild);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&reload.wakeup, pchild);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_create(&reload.watcher, NULL, reload_watcher, s, pchild);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_replace: Cannot start the rule reload thread, rules stay as loaded");
+        return;
+    }
+    apr_pool_cleanup_register(pchild, NULL, stop_reload_watcher, apr_pool_cleanup_null);
+#else
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                 "mod_replace: ReplaceReloadInterval needs thread support, rules stay as loaded");
+#endif
+}
+
+static void replace_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    // pconf is read-only once requests are served: entries added from now on
+    // go to a child pool, guarded by a mutex in threaded MPMs
+    apr_pool_create(&merge_cache.pool, pchild);
+    merge_cache.automata = apr_hash_copy(merge_cache.pool, merge_cache.automata);
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&merge_cache.lock, APR_THREAD_MUTEX_NESTED, pchild);
+    apr_threadkey_private_create(&random_key, free, pchild);
+#endif
+
+    if (reload.interval > 0 && reload.lives->nelts > 0) {
+        start_reload_watcher(pchild, s);
+    }
+}
+
 static void register_hooks(apr_pool_t *pool)
 {
     ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, pool, "mod_replace: Registering hooks");
+    ap_hook_pre_config(replace_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(replace_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(replace_child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_register_output_filter("REPLACE", replace_output_filter, NULL, AP_FTYPE_RESOURCE);
     ap_hook_insert_filter(insert_replace_filter, NULL, NULL, APR_HOOK_MIDDLE);
 }
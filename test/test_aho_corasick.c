@@ -167,6 +167,7 @@ void test_stats() {
     assert(ac_add_pattern(ac, "a", 0, "1", 0));
     assert(ac_add_pattern(ac, "ab", 0, "12", 0));
     assert(ac_add_pattern(ac, "abc", 0, "123", 0));
+    assert(ac_set_keep_trie(ac, true));
     assert(ac_compile(ac));
     
     size_t node_count = 0, pattern_count = 0, memory_usage = 0;
@@ -180,6 +181,667 @@ void test_stats() {
     assert(node_count > 0);
     assert(memory_usage > 0);
     
+    // Root plus one node per byte; classes 'a', 'b', 'c' plus "other"
+    ac_memory_stats_t stats;
+    ac_get_memory_stats(ac, &stats);
+    printf("  Image: %zu bytes (transitions %zu, outputs %zu, strings %zu)\n",
+           stats.image_bytes, stats.transition_bytes, stats.output_bytes, stats.string_bytes);
+    assert(stats.state_count == 4);
+    assert(stats.class_count == 4);
+    assert(stats.pattern_count == 3);
+    assert(stats.transition_bytes == 4 * 5 * sizeof(uint32_t));
+    assert(stats.string_bytes == (1 + 1 + 1 + 1) + (2 + 1 + 2 + 1) + (3 + 1 + 3 + 1));
+    assert(stats.image_bytes >= stats.transition_bytes + stats.output_bytes + stats.string_bytes);
+    assert(stats.trie_bytes == 4 * sizeof(ac_node_t));
+    assert(memory_usage == sizeof(ac_automaton_t) + stats.trie_bytes + stats.image_bytes + stats.table_bytes);
+    
+    // Pattern counts track additions and removals without a rescan
+    assert(ac_remove_pattern(ac, "ab", 0));
+    ac_get_stats(ac, NULL, &pattern_count, NULL);
+    assert(pattern_count == 2);
+    
+    // By default the trie goes with compile; states are then counted from the image
+    ac_set_keep_trie(ac, false);
+    assert(ac_compile(ac));
+    ac_get_memory_stats(ac, &stats);
+    ac_get_stats(ac, &node_count, &pattern_count, NULL);
+    assert(ac->nodes == NULL && ac->pattern_nodes == NULL);
+    assert(stats.trie_bytes == 0);
+    assert(node_count == stats.state_count && node_count == 4);
+    assert(pattern_count == 2);
+    assert(!ac_add_pattern(ac, "b", 0, "2", 0));
+    assert(!ac_set_keep_trie(ac, true));
+    
+    ac_destroy(ac);
+    printf("  ✓ Passed\n\n");
+}
+
+void test_pool_growth() {
+    printf("Test 8: Node pool growth and trimming...\n");
+    
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac->node_capacity == AC_DEFAULT_NODE_CAPACITY);
+    
+    // Far more nodes than the initial pool holds
+    static char patterns[500][16];
+    static char replacements[500][16];
+    for (int i = 0; i < 500; i++) {
+        snprintf(patterns[i], sizeof(patterns[i]), "key%d;", i);
+        snprintf(replacements[i], sizeof(replacements[i]), "val%d;", i);
+        assert(ac_add_pattern(ac, patterns[i], 0, replacements[i], 0));
+    }
+    assert(ac_set_keep_trie(ac, true));
+    assert(ac_compile(ac));
+    
+    printf("  Nodes: %zu, capacity after compile: %zu\n", ac->node_count, ac->node_capacity);
+    assert(ac->node_capacity == ac->node_count);
+    
+    const char *text = "key0; key42; key499; key500;";
+    size_t result_len = 0;
+    char *result = ac_replace_alloc(ac, text, strlen(text), &result_len);
+    
+    printf("  Original: \"%s\"\n", text);
+    printf("  Result:   \"%.*s\"\n", (int)result_len, result);
+    
+    assert(result != NULL);
+    assert(strcmp(result, "val0; val42; val499; key500;") == 0);
+    
+    free(result);
+    ac_destroy(ac);
+    printf("  ✓ Passed\n\n");
+}
+
+void test_image_relocation() {
+    printf("Test 9: Relocating the compiled image...\n");
+    
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern(ac, "he", 0, "HE", 0));
+    assert(ac_add_pattern(ac, "she", 0, "SHE", 0));
+    assert(ac_add_pattern(ac, "hers", 0, "HERS", 0));
+    assert(ac_image_size(ac) == 0);
+    assert(ac_compile(ac));
+    
+    size_t size = ac_image_size(ac);
+    printf("  Image size: %zu bytes\n", size);
+    assert(size > 0);
+    
+    // The image holds no pointers, so any aligned copy searches the same
+    uint64_t *buffer = calloc(size / sizeof(uint64_t) + 1, sizeof(uint64_t));
+    assert(buffer != NULL);
+    assert(!ac_relocate_image(ac, buffer, size - 1));
+    assert(ac_relocate_image(ac, buffer, size));
+    assert(ac->nodes == NULL);
+    assert(!ac_add_pattern(ac, "his", 0, "HIS", 0));
+    
+    const char *text = "ushers said hers";
+    size_t result_len = 0;
+    char *result = ac_replace_alloc(ac, text, strlen(text), &result_len);
+    
+    printf("  Original: \"%s\"\n", text);
+    printf("  Result:   \"%.*s\"\n", (int)result_len, result);
+    
+    assert(result != NULL);
+    assert(strcmp(result, "uSHErs said HErs") == 0);
+    
+    free(result);
+    ac_destroy(ac);
+    free(buffer);
+    printf("  ✓ Passed\n\n");
+}
+
+static const char *upper_callback(const char *pattern, size_t pattern_len,
+                                  void *user_data, void *context_data,
+                                  size_t *replacement_len) {
+    (void)pattern;
+    (void)pattern_len;
+    (void)context_data;
+    *replacement_len = strlen((const char *)user_data);
+    return (const char *)user_data;
+}
+
+void test_save_load() {
+    printf("Test 10: Saving and loading the compiled image...\n");
+    
+    const char *path = "test_aho_corasick.img";
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern(ac, "cat", 0, "dog", 0));
+    assert(ac_add_pattern(ac, "bird", 0, "fish", 0));
+    assert(ac_add_pattern_ex(ac, "mouse", 0, NULL, 0, NULL));
+    assert(!ac_save(ac, path));
+    assert(ac_compile(ac));
+    assert(ac_save(ac, path));
+    ac_destroy(ac);
+    
+    ac_automaton_t *loaded = ac_load(path);
+    assert(loaded != NULL);
+    assert(loaded->is_compiled);
+    
+    size_t pattern_count = 0;
+    ac_get_stats(loaded, NULL, &pattern_count, NULL);
+    assert(pattern_count == 3);
+    assert(!ac_add_pattern(loaded, "fox", 0, "wolf", 0));
+    
+    const char *text = "The cat saw a bird";
+    size_t result_len = 0;
+    char *result = ac_replace_alloc(loaded, text, strlen(text), &result_len);
+    printf("  Static:   \"%.*s\"\n", (int)result_len, result);
+    assert(result != NULL);
+    assert(strcmp(result, "The dog saw a fish") == 0);
+    free(result);
+    
+    // User data is not saved; reattach it by pattern id
+    for (size_t id = 0; id < pattern_count; id++) {
+        const char *pattern = NULL, *replacement = NULL;
+        assert(ac_get_pattern(loaded, id, &pattern, NULL, &replacement, NULL));
+        if (strcmp(pattern, "mouse") == 0) {
+            assert(replacement == NULL);
+            assert(ac_set_user_data(loaded, id, "MOUSE"));
+        } else {
+            assert(replacement != NULL);
+            assert(ac_set_user_data(loaded, id, (void *)replacement));
+        }
+    }
+    assert(!ac_get_pattern(loaded, pattern_count, NULL, NULL, NULL, NULL));
+    
+    text = "The cat saw a bird and a mouse";
+    result = ac_replace_with_callback(loaded, text, strlen(text), upper_callback, NULL, &result_len);
+    printf("  Callback: \"%.*s\"\n", (int)result_len, result);
+    assert(result != NULL);
+    assert(strcmp(result, "The dog saw a fish and a MOUSE") == 0);
+    free(result);
+    
+    // Saving over a loaded image replaces the file, not the mapped pages
+    ac_automaton_t *other = ac_create(0);
+    assert(other != NULL);
+    assert(ac_add_pattern(other, "cat", 0, "lion", 0));
+    assert(ac_compile(other));
+    assert(ac_save(other, path));
+    ac_destroy(other);
+    text = "The cat saw a bird";
+    result = ac_replace_alloc(loaded, text, strlen(text), &result_len);
+    assert(result != NULL);
+    assert(strcmp(result, "The dog saw a fish") == 0);
+    free(result);
+    ac_destroy(loaded);
+    loaded = ac_load(path);
+    assert(loaded != NULL);
+    result = ac_replace_alloc(loaded, text, strlen(text), &result_len);
+    assert(result != NULL);
+    assert(strcmp(result, "The lion saw a bird") == 0);
+    free(result);
+    ac_destroy(loaded);
+    
+    // A damaged file is rejected by the checksum
+    FILE *file = fopen(path, "r+b");
+    assert(file != NULL);
+    fseek(file, -1, SEEK_END);
+    int last = fgetc(file);
+    fseek(file, -1, SEEK_END);
+    fputc(last ^ 0x5a, file);
+    fclose(file);
+    assert(ac_load(path) == NULL);
+    
+    // A pattern longer than the bytes that reach its state is rejected even
+    // with a valid checksum: "cat" stretched over "cat\0dog" would make
+    // matches start before the text
+    ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern(ac, "cat", 0, "dog", 0));
+    assert(ac_compile(ac));
+    assert(ac_save(ac, path));
+    ac_destroy(ac);
+    file = fopen(path, "r+b");
+    assert(file != NULL);
+    uint64_t size = 0, pattern_offset = 0, hash = 0xcbf29ce484222325ULL, word;
+    uint32_t stretched = 7;
+    fseek(file, 16, SEEK_SET);   // ac_image_header_t.size
+    assert(fread(&size, sizeof(size), 1, file) == 1);
+    fseek(file, 56, SEEK_SET);   // ac_image_header_t.pattern_offset
+    assert(fread(&pattern_offset, sizeof(pattern_offset), 1, file) == 1);
+    fseek(file, (long)pattern_offset + 8, SEEK_SET);   // First ac_image_pattern_t.pattern_len
+    fwrite(&stretched, sizeof(stretched), 1, file);
+    fseek(file, 0, SEEK_SET);
+    for (uint64_t offset = 0; offset < size; offset += sizeof(word)) {
+        assert(fread(&word, sizeof(word), 1, file) == 1);
+        hash = (hash ^ (offset == 24 ? 0 : word)) * 0x100000001b3ULL;   // Checksum field reads as 0
+    }
+    fseek(file, 24, SEEK_SET);   // ac_image_header_t.checksum
+    fwrite(&hash, sizeof(hash), 1, file);
+    fclose(file);
+    assert(ac_load(path) == NULL);
+    
+    remove(path);
+    assert(ac_load(path) == NULL);
+    printf("  ✓ Passed\n\n");
+}
+
+typedef struct {
+    size_t end[256];
+    size_t len[256];
+    size_t count;
+} match_log_t;
+
+static bool log_match(const ac_match_t *match, void *user_data) {
+    match_log_t *log = (match_log_t *)user_data;
+    if (log->count < 256) {
+        log->end[log->count] = match->end_pos;
+        log->len[log->count] = match->pattern_len;
+    }
+    log->count++;
+    return true;
+}
+
+void test_incremental_updates() {
+    printf("Test 11: Adding and removing patterns after compile...\n");
+    
+    // Every pattern over {a, b} up to length 3, so insertions and removals
+    // keep landing on each other's suffixes
+    static char candidates[14][4];
+    size_t candidate_count = 0;
+    for (size_t len = 1; len <= 3; len++) {
+        for (size_t bits = 0; bits < (1u << len); bits++) {
+            for (size_t i = 0; i < len; i++) {
+                candidates[candidate_count][i] = (bits >> i) & 1 ? 'b' : 'a';
+            }
+            candidates[candidate_count][len] = '\0';
+            candidate_count++;
+        }
+    }
+    bool present[14] = { false };
+    const char *text = "abbabaabbbaababbaaab";
+    
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_set_keep_trie(ac, true));
+    assert(ac_compile(ac));
+    
+    srand(7);
+    for (int step = 0; step < 400; step++) {
+        size_t pick = (size_t)rand() % candidate_count;
+        if (present[pick]) {
+            assert(ac_remove_pattern(ac, candidates[pick], 0));
+            assert(!ac_remove_pattern(ac, candidates[pick], 0));
+        } else {
+            assert(ac_add_pattern(ac, candidates[pick], 0, "x", 0));
+        }
+        present[pick] = !present[pick];
+        assert(ac->is_compiled);
+        
+        // Compare against a fresh automaton with the same patterns
+        ac_automaton_t *fresh = ac_create(0);
+        assert(fresh != NULL);
+        for (size_t i = 0; i < candidate_count; i++) {
+            if (present[i]) assert(ac_add_pattern(fresh, candidates[i], 0, "x", 0));
+        }
+        assert(ac_compile(fresh));
+        
+        match_log_t expected = {0}, actual = {0};
+        ac_search(fresh, text, strlen(text), log_match, &expected);
+        if (step % 50 == 49) assert(ac_compile(ac));
+        ac_search(ac, text, strlen(text), log_match, &actual);
+        assert(actual.count == expected.count);
+        for (size_t i = 0; i < expected.count && i < 256; i++) {
+            assert(actual.end[i] == expected.end[i]);
+            assert(actual.len[i] == expected.len[i]);
+        }
+        
+        size_t fresh_nodes = 0, nodes = 0;
+        ac_get_stats(fresh, &fresh_nodes, NULL, NULL);
+        ac_get_stats(ac, &nodes, NULL, NULL);
+        assert(nodes == fresh_nodes);
+        ac_destroy(fresh);
+    }
+    
+    // Removed nodes are reused, and the result still flattens to an image
+    assert(ac->node_count <= 15);
+    assert(ac_compile(ac));
+    assert(ac_image_size(ac) > 0);
+    assert(!ac_remove_pattern(ac, "abab", 0));
+    
+    ac_destroy(ac);
+    printf("  ✓ Passed\n\n");
+}
+
+static int decline_calls = 0;
+
+static const char *decline_callback(const char *pattern, size_t pattern_len,
+                                    void *user_data, void *context_data,
+                                    size_t *replacement_len) {
+    (void)pattern;
+    (void)pattern_len;
+    (void)context_data;
+    decline_calls++;
+    if (!user_data) return NULL;
+    *replacement_len = strlen((const char *)user_data);
+    return (const char *)user_data;
+}
+
+void test_declined_matches() {
+    printf("Test 12: Declined matches give way to overlapping ones...\n");
+    
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern_ex(ac, "she", 0, NULL, 0, NULL));
+    assert(ac_add_pattern_ex(ac, "hers", 0, NULL, 0, "X"));
+    assert(ac_add_pattern_ex(ac, "us", 0, NULL, 0, "U"));
+    assert(ac_compile(ac));
+    
+    // "she" is declined, so "hers" starting inside it applies
+    const char *text = "ushers";
+    size_t result_len = 0;
+    char *result = ac_replace_with_callback(ac, text, strlen(text), decline_callback, NULL, &result_len);
+    printf("  Result: \"%.*s\"\n", (int)result_len, result);
+    assert(result != NULL);
+    assert(strcmp(result, "UX") == 0);
+    free(result);
+    
+    // Only matches that can still apply reach the callback
+    decline_calls = 0;
+    text = "usher";
+    result = ac_replace_with_callback(ac, text, strlen(text), decline_callback, NULL, &result_len);
+    assert(result != NULL);
+    assert(strcmp(result, "Uher") == 0);
+    assert(decline_calls == 1);
+    free(result);
+    
+    ac_destroy(ac);
+    printf("  ✓ Passed\n\n");
+}
+
+void test_static_fast_path() {
+    printf("Test 13: Static patterns bypass the callback...\n");
+    
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern(ac, "cat", 0, "dog", 0));
+    assert(ac_add_pattern_ex(ac, "empty", 0, "", 0, NULL));
+    assert(ac_add_pattern_ex(ac, "bird", 0, NULL, 0, "FISH"));
+    assert(ac_set_keep_trie(ac, true));
+    assert(ac_compile(ac));
+    
+    // Static and dynamic patterns apply in one scan; only "bird" reaches the callback
+    const char *text = "cat bird empty cat";
+    size_t result_len = 0;
+    decline_calls = 0;
+    char *result = ac_replace_with_callback(ac, text, strlen(text), decline_callback, NULL, &result_len);
+    printf("  Result: \"%.*s\"\n", (int)result_len, result);
+    assert(result != NULL);
+    assert(strcmp(result, "dog FISH  dog") == 0);
+    assert(decline_calls == 1);
+    free(result);
+    
+    // Same with the trie, after an incremental update
+    assert(ac_add_pattern(ac, "dog", 0, "wolf", 0));
+    decline_calls = 0;
+    text = "dog bird";
+    result = ac_replace_with_callback(ac, text, strlen(text), decline_callback, NULL, &result_len);
+    assert(result != NULL);
+    assert(strcmp(result, "wolf FISH") == 0);
+    assert(decline_calls == 1);
+    free(result);
+    
+    ac_destroy(ac);
+    printf("  ✓ Passed\n\n");
+}
+
+void test_case_insensitive() {
+    printf("Test 14: Case-insensitive matching...\n");
+    
+    const char *path = "test_aho_corasick_nocase.img";
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_set_case_insensitive(ac, true));
+    assert(ac_add_pattern(ac, "OldProduct", 0, "NewProduct", 0));
+    assert(ac_add_pattern(ac, "a@", 0, "at", 0));
+    assert(!ac_set_case_insensitive(ac, false));
+    assert(ac_set_keep_trie(ac, true));
+    assert(ac_compile(ac));
+    
+    // Only letters fold: '`' is not '@' in another case
+    const char *text = "OLDPRODUCT, oldproduct, OldProduct, A@ a`";
+    const char *expected = "NewProduct, NewProduct, NewProduct, at a`";
+    size_t result_len = 0;
+    char *result = ac_replace_alloc(ac, text, strlen(text), &result_len);
+    printf("  Result: \"%.*s\"\n", (int)result_len, result);
+    assert(result != NULL);
+    assert(strcmp(result, expected) == 0);
+    free(result);
+    
+    // The image keeps the setting
+    assert(ac_save(ac, path));
+    ac_automaton_t *loaded = ac_load(path);
+    assert(loaded != NULL);
+    assert(loaded->case_insensitive);
+    result = ac_replace_alloc(loaded, text, strlen(text), &result_len);
+    assert(result != NULL);
+    assert(strcmp(result, expected) == 0);
+    free(result);
+    ac_destroy(loaded);
+    remove(path);
+    
+    // Incremental updates fold as well; same letters in another case are the same pattern
+    assert(ac_add_pattern(ac, "OLDPRODUCT", 0, "Product2", 0));
+    assert(ac_add_pattern(ac, "Zz", 0, "z", 0));
+    size_t pattern_count = 0;
+    ac_get_stats(ac, NULL, &pattern_count, NULL);
+    assert(pattern_count == 3);
+    text = "oldProduct zZ";
+    result = ac_replace_alloc(ac, text, strlen(text), &result_len);
+    assert(result != NULL);
+    assert(strcmp(result, "Product2 z") == 0);
+    free(result);
+    
+    ac_destroy(ac);
+    printf("  ✓ Passed\n\n");
+}
+
+// Extends a "?v=" match over the digits that follow it
+static const char *version_callback(const char *text, size_t text_len, size_t min_start,
+                                    ac_match_t *match, void *user_data, void *context_data,
+                                    size_t *replacement_len) {
+    (void)min_start;
+    (void)context_data;
+    size_t end = match->end_pos + 1;
+    while (end < text_len && text[end] >= '0' && text[end] <= '9') end++;
+    if (end == match->end_pos + 1) return NULL;
+    match->end_pos = end - 1;
+    *replacement_len = strlen((const char *)user_data);
+    return (const char *)user_data;
+}
+
+void test_span_callback() {
+    printf("Test 15: Callbacks choosing the replaced span...\n");
+    
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern_ex(ac, "?v=", 0, NULL, 0, "?v=2"));
+    assert(ac_add_pattern(ac, "123", 0, "X", 0));
+    assert(ac_add_pattern(ac, "app", 0, "main", 0));
+    assert(ac_compile(ac));
+    
+    // "123" lies inside the extended span and is skipped; "?v=" without digits is declined
+    const char *text = "app.js?v=123 app.css?v= 123";
+    size_t result_len = 0;
+    char *result = ac_replace_with_span_callback(ac, text, strlen(text), version_callback, NULL, &result_len);
+    printf("  Result: \"%.*s\"\n", (int)result_len, result);
+    assert(result != NULL);
+    assert(strcmp(result, "main.js?v=2 main.css?v= X") == 0);
+    assert(result_len == strlen(result));
+    free(result);
+    
+    ac_destroy(ac);
+    printf("  ✓ Passed\n\n");
+}
+
+void test_boundaries() {
+    printf("Test 16: Word and path boundaries...\n");
+    
+    const char *path = "test_aho_corasick_boundaries.img";
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern(ac, "v1.0", 0, "v2.0", 0));
+    assert(ac_add_pattern(ac, "img", 0, "static", 0));
+    assert(ac_set_keep_trie(ac, true));
+    assert(ac_compile(ac));
+    assert(!ac_set_boundaries(ac, "v1", 0, AC_BOUNDARY_WORD, AC_BOUNDARY_WORD));
+    assert(ac_set_boundaries(ac, "v1.0", 0, AC_BOUNDARY_WORD, AC_BOUNDARY_WORD));
+    assert(ac_set_boundaries(ac, "img", 0, AC_BOUNDARY_PATH, AC_BOUNDARY_PATH));
+    
+    // Checked on the trie until compiled again, then on the image
+    const char *text = "v1.0 v1.01 xv1.0 (v1.0) /img/a.png /imgs/b.png";
+    const char *expected = "v2.0 v1.01 xv1.0 (v2.0) /static/a.png /imgs/b.png";
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) assert(ac_compile(ac));
+        size_t result_len = 0;
+        char *result = ac_replace_alloc(ac, text, strlen(text), &result_len);
+        printf("  Result: \"%.*s\"\n", (int)result_len, result);
+        assert(result != NULL);
+        assert(strcmp(result, expected) == 0);
+        free(result);
+    }
+    
+    // Saved with the image; rejected matches never reach the callback
+    assert(ac_save(ac, path));
+    ac_automaton_t *loaded = ac_load(path);
+    assert(loaded != NULL);
+    match_log_t log = { { 0 }, { 0 }, 0 };
+    assert(ac_search(loaded, text, strlen(text), log_match, &log) == 3);
+    assert(log.count == 3);
+    assert(log.end[2] == 27 && log.len[2] == 3);
+    ac_destroy(loaded);
+    remove(path);
+    
+    assert(ac_boundaries_hold("a-b", 3, 2, 2, AC_BOUNDARY_WORD, AC_BOUNDARY_WORD));
+    assert(!ac_boundaries_hold("ab", 2, 1, 1, AC_BOUNDARY_WORD, AC_BOUNDARY_NONE));
+    
+    ac_destroy(ac);
+    printf("  ✓ Passed\n\n");
+}
+
+void test_html_contexts() {
+    printf("Test 17: HTML contexts...\n");
+    
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern(ac, "old", 0, "new", 0));
+    assert(ac_add_pattern(ac, "cdn", 0, "static", 0));
+    assert(ac_add_pattern(ac, "TODO", 0, "", 0));
+    assert(ac_set_keep_trie(ac, true));
+    assert(ac_compile(ac));
+    assert(!ac_set_contexts(ac, "old", 0, 0x20));
+    assert(ac_set_contexts(ac, "old", 0, AC_CONTEXT_TEXT));
+    assert(ac_set_contexts(ac, "cdn", 0, AC_CONTEXT_ATTRIBUTE));
+    assert(ac_set_contexts(ac, "TODO", 0, AC_CONTEXT_COMMENT));
+    
+    // "old" only in text, "cdn" only in attribute values, "TODO" only in comments;
+    // "a < old" is text, and </script> ends the script however it is spelled
+    const char *text = "<p class=old title='cdn'>old cdn</p><!-- TODO old -->"
+                       "<script>var old = 'cdn'; // TODO</SCRIPT>a < old <img src=cdn/x.png>";
+    const char *expected = "<p class=old title='static'>new cdn</p><!--  old -->"
+                           "<script>var old = 'cdn'; // TODO</SCRIPT>a < new <img src=static/x.png>";
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) assert(ac_compile(ac));
+        size_t result_len = 0;
+        char *result = ac_replace_alloc(ac, text, strlen(text), &result_len);
+        printf("  Result: \"%.*s\"\n", (int)result_len, result);
+        assert(result != NULL);
+        assert(strcmp(result, expected) == 0);
+        free(result);
+    }
+    
+    // A match must not span two contexts
+    ac_reset(ac);
+    assert(ac_add_pattern(ac, "a\"", 0, "b\"", 0));
+    assert(ac_compile(ac));
+    assert(ac_set_contexts(ac, "a\"", 0, AC_CONTEXT_ATTRIBUTE | AC_CONTEXT_TAG));
+    assert(ac_compile(ac));
+    size_t result_len = 0;
+    text = "<i x=\"a\">a\"";
+    char *result = ac_replace_alloc(ac, text, strlen(text), &result_len);
+    assert(result != NULL);
+    assert(strcmp(result, text) == 0);
+    free(result);
+    ac_destroy(ac);
+    
+    // A match may fill its context run exactly, but not start or end one
+    // byte outside it, even in another context of its mask
+    static const struct {
+        const char *pattern, *replacement;
+        unsigned contexts;
+        const char *text, *expected;
+    } runs[] = {
+        { "cdn", "CDN", AC_CONTEXT_ATTRIBUTE, "<i x=\"cdn\">", "<i x=\"CDN\">" },
+        { "=\"cdn", "=\"CDN", AC_CONTEXT_ATTRIBUTE | AC_CONTEXT_TAG, "<i x=\"cdn\">", "<i x=\"cdn\">" },
+        { "cdn\"", "CDN\"", AC_CONTEXT_ATTRIBUTE | AC_CONTEXT_TAG, "<i x=\"cdn\">", "<i x=\"cdn\">" },
+        { "cdn", "CDN", AC_CONTEXT_TEXT, "<i>cdn</i>", "<i>CDN</i>" },
+        { "<i>c", "<b>c", AC_CONTEXT_TEXT | AC_CONTEXT_TAG, "<i>cdn</i>", "<i>cdn</i>" },
+        { "n</i>", "N</i>", AC_CONTEXT_TEXT | AC_CONTEXT_TAG, "<i>cdn</i>", "<i>cdn</i>" },
+    };
+    for (size_t k = 0; k < sizeof(runs) / sizeof(runs[0]); k++) {
+        ac = ac_create(0);
+        assert(ac != NULL);
+        assert(ac_add_pattern(ac, runs[k].pattern, 0, runs[k].replacement, 0));
+        assert(ac_set_keep_trie(ac, true));
+        assert(ac_compile(ac));
+        assert(ac_set_contexts(ac, runs[k].pattern, 0, runs[k].contexts));
+        for (int pass = 0; pass < 2; pass++) {
+            if (pass == 1) assert(ac_compile(ac));
+            result = ac_replace_alloc(ac, runs[k].text, strlen(runs[k].text), &result_len);
+            assert(result != NULL);
+            assert(strcmp(result, runs[k].expected) == 0);
+            free(result);
+        }
+        ac_destroy(ac);
+    }
+    
+    printf("  ✓ Passed\n\n");
+}
+
+void test_prefix_replacement() {
+    printf("Test 18: Replacing within a prefix...\n");
+    
+    ac_automaton_t *ac = ac_create(0);
+    assert(ac != NULL);
+    assert(ac_add_pattern(ac, "cat", 0, "dog", 0));
+    assert(ac_add_pattern(ac, "sat", 0, "ran", 0));
+    assert(ac_add_pattern_ex(ac, "?v=", 0, NULL, 0, "?v=2"));
+    assert(ac_set_boundaries(ac, "cat", 0, AC_BOUNDARY_WORD, AC_BOUNDARY_WORD));
+    assert(ac_set_keep_trie(ac, true));
+    assert(ac_compile(ac));
+    
+    // A match ending at the edge of the prefix is judged by the byte after
+    // it; matches and spans past the edge are left alone
+    static const struct {
+        const char *text;
+        size_t scan_len;
+        const char *expected;
+    } cases[] = {
+        { "the cats sat", 7, "the cats sat" },
+        { "the cat sat", 7, "the dog sat" },
+        { "the cat sat", 10, "the dog sat" },
+        { "the cat sat", 11, "the dog ran" },
+        { "the cat", 7, "the dog" },
+        { "a.js?v=12", 7, "a.js?v=12" },
+        { "a.js?v=12", 9, "a.js?v=2" },
+    };
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) assert(ac_compile(ac));
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            size_t result_len = 0;
+            char *result = ac_replace_prefix_with_span_callback(ac, cases[i].text, strlen(cases[i].text),
+                                                                cases[i].scan_len, version_callback,
+                                                                NULL, &result_len);
+            assert(result != NULL);
+            assert(strcmp(result, cases[i].expected) == 0);
+            free(result);
+        }
+    }
+    size_t result_len = 0;
+    assert(ac_replace_prefix_with_span_callback(ac, "cat", 3, 4, version_callback, NULL, &result_len) == NULL);
+    
     ac_destroy(ac);
     printf("  ✓ Passed\n\n");
 }
@@ -194,6 +856,17 @@ int main() {
     test_no_matches();
     test_allocation_version();
     test_stats();
+    test_pool_growth();
+    test_image_relocation();
+    test_save_load();
+    test_incremental_updates();
+    test_declined_matches();
+    test_static_fast_path();
+    test_case_insensitive();
+    test_span_callback();
+    test_boundaries();
+    test_html_contexts();
+    test_prefix_replacement();
     
     printf("=== All tests passed! ===\n");
     return 0;
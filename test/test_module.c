@@ -0,0 +1,316 @@
+/*
+ * Tests for the module's own request path
+ *
+ * Builds src/mod_replace.c with TEST_BUILD and drives perform_replacements
+ * the way the output filter does: one config compiled up front, one APR pool
+ * per request, variable rules expanded on every match. A million requests
+ * must leave the resident set flat, so no per-request allocation may land in
+ * the configuration pool or the shared automaton. The built-in CSP nonce is
+ * timed against the same rule reading mod_unique_id's value from the
+ * request environment. ReplaceScanLimit is checked on real buckets, cut
+ * where the output filter cuts them.
+ *
+ * httpd itself is not linked: the paths exercised here only call APR, and
+ * the httpd functions they reach are defined below.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/resource.h>
+#include "apr_general.h"
+#include "apr_buckets.h"
+#include "../src/mod_replace.c"
+
+#define TEST_REQUESTS 1000000
+#define TEST_MAX_GROWTH_KB 1024
+#define TEST_NONCE_RESPONSES 200000
+#define TEST_ENV_ENTRIES 32
+
+// Configs created by the tests behave as if read at startup
+AP_DECLARE(int) ap_state_query(int query)
+{
+    (void)query;
+    return AP_SQ_MS_RUN_MPM;
+}
+
+// Peak resident set size in KB
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// A config with these rules, compiled as post_config would
+static replace_config *make_config(apr_pool_t *pconf, const char *const *rules,
+                                   const replace_rule_options *options)
+{
+    replace_config *cfg;
+
+    memset(&merge_cache, 0, sizeof(merge_cache));
+    merge_cache.pool = pconf;
+    merge_cache.automata = apr_hash_make(pconf);
+    pending_configs = apr_array_make(pconf, 1, sizeof(replace_config *));
+
+    cfg = create_replace_config(pconf, NULL);
+    cfg->enabled = 1;
+    for (; rules[0]; rules += 2) {
+        add_replace_rule(cfg, rules[0], make_rule(pconf, rules[1], options));
+    }
+    compile_config_automaton(cfg);
+    pending_configs = NULL;
+
+    assert(cfg->automaton_compiled);
+    return cfg;
+}
+
+void test_request_memory(apr_pool_t *pconf)
+{
+    static const char *const rules[] = {
+        "{{SITE}}", "Example",
+        "{{ASSET}}", "https://${REPLACE_TEST_HOST}/assets",
+        "{{USER}}", "${REPLACE_TEST_USER}@${REPLACE_TEST_HOST}",
+        NULL
+    };
+    static const char body[] =
+        "<html><head><title>{{SITE}}</title>"
+        "<link href='{{ASSET}}/site.css'></head>"
+        "<body>{{USER}} <img src='{{ASSET}}/logo.png'></body></html>";
+    static const char expected[] =
+        "<html><head><title>Example</title>"
+        "<link href='https://static.example.com/assets/site.css'></head>"
+        "<body>ops@static.example.com <img src='https://static.example.com/assets/logo.png'></body></html>";
+
+    printf("Test 1: Request memory (%d requests)...\n", TEST_REQUESTS);
+
+    // Environment variables are read when the rules are compiled
+    setenv("REPLACE_TEST_HOST", "static.example.com", 1);
+    setenv("REPLACE_TEST_USER", "ops", 1);
+    replace_config *cfg = make_config(pconf, rules, NULL);
+
+    int warmup = TEST_REQUESTS / 10;
+    long baseline = 0;
+
+    for (int i = 0; i < TEST_REQUESTS; i++) {
+        apr_pool_t *request;
+        apr_size_t len;
+
+        if (i == warmup) {
+            baseline = peak_rss_kb();
+        }
+        assert(apr_pool_create(&request, pconf) == APR_SUCCESS);
+        char *result = perform_replacements(request, body, sizeof(body) - 1, sizeof(body) - 1,
+                                            cfg, NULL, apr_hash_make(request), &len);
+        if (i == 0) {
+            printf("  Output: %.*s\n", (int)len, result);
+            assert(len == sizeof(expected) - 1 && memcmp(result, expected, len) == 0);
+        }
+        apr_pool_destroy(request);
+    }
+
+    long growth = peak_rss_kb() - baseline;
+    printf("  RSS growth after warm-up: %ld KB\n", growth);
+    assert(growth <= TEST_MAX_GROWTH_KB);
+    printf("  ✓ Passed\n\n");
+}
+
+// A main request as the output filter sees it, with a typical environment
+static request_rec *make_request(apr_pool_t *pool, const char *unique_string)
+{
+    request_rec *r = apr_pcalloc(pool, sizeof(request_rec));
+
+    r->pool = pool;
+    r->notes = apr_table_make(pool, 4);
+    r->subprocess_env = apr_table_make(pool, TEST_ENV_ENTRIES);
+    for (int i = 0; i < TEST_ENV_ENTRIES - 1; i++) {
+        apr_table_setn(r->subprocess_env, apr_psprintf(pool, "TEST_VAR_%d", i), "value");
+    }
+    apr_table_setn(r->subprocess_env, "UNIQUE_STRING", unique_string);
+    return r;
+}
+
+// Time TEST_NONCE_RESPONSES responses through cfg, checking each result
+static double time_nonce_responses(apr_pool_t *pconf, replace_config *cfg,
+                                   const char *body, apr_size_t body_len,
+                                   const char *unique_string, int builtin)
+{
+    char previous[32] = "";
+    apr_time_t start = apr_time_now();
+
+    for (int i = 0; i < TEST_NONCE_RESPONSES; i++) {
+        apr_pool_t *pool;
+        apr_size_t len;
+
+        assert(apr_pool_create(&pool, pconf) == APR_SUCCESS);
+        request_rec *r = make_request(pool, unique_string);
+        char *result = perform_replacements(pool, body, body_len, body_len, cfg, r, NULL, &len);
+
+        // "<script nonce='N'></script><style nonce='N'></style>"
+        const char *first = strstr(result, "nonce='") + 7;
+        const char *second = strstr(first, "nonce='") + 7;
+        apr_size_t nonce_len = strchr(first, '\'') - first;
+        assert(strncmp(first, second, nonce_len) == 0 && second[nonce_len] == '\'');
+        if (builtin) {
+            assert(nonce_len == 24);
+            assert(strncmp(first, apr_table_get(r->notes, "CSP_NONCE"), nonce_len) == 0);
+            assert(strncmp(first, previous, nonce_len) != 0);
+            memcpy(previous, first, nonce_len);
+        }
+        apr_pool_destroy(pool);
+    }
+    return (double)(apr_time_now() - start) / TEST_NONCE_RESPONSES;
+}
+
+void test_csp_nonce(apr_pool_t *pconf)
+{
+    static const char *const builtin_rules[] = {
+        "___CSP_NONCE___", "${CSP_NONCE}",
+        NULL
+    };
+    static const char *const env_rules[] = {
+        "___CSP_NONCE___", "%{UNIQUE_STRING}",
+        NULL
+    };
+    static const char body[] =
+        "<script nonce='___CSP_NONCE___'></script><style nonce='___CSP_NONCE___'></style>";
+
+    printf("Test 2: CSP nonce (%d responses)...\n", TEST_NONCE_RESPONSES);
+
+#if APR_HAS_THREADS
+    // As child_init does, so random bytes come from the per-thread buffer
+    assert(apr_threadkey_private_create(&random_key, free, pconf) == APR_SUCCESS);
+#endif
+    replace_config *builtin = make_config(pconf, builtin_rules, NULL);
+    replace_config *env = make_config(pconf, env_rules, NULL);
+
+    double builtin_us = time_nonce_responses(pconf, builtin, body, sizeof(body) - 1, NULL, 1);
+    // mod_unique_id's own cost of producing the value is not counted
+    double env_us = time_nonce_responses(pconf, env, body, sizeof(body) - 1,
+                                         "ZxY3kQAAAAEAAC3aF2sAAAAB", 0);
+
+    printf("  ${CSP_NONCE}:      %.3f μs/response\n", builtin_us);
+    printf("  %%{UNIQUE_STRING}:  %.3f μs/response (apr_table_get, value precomputed)\n", env_us);
+    printf("  ✓ Passed\n\n");
+}
+
+/*
+ * Run a body, arriving in these chunks, through the ReplaceScanLimit steps
+ * of replace_output_filter, and return what it passes on
+ */
+static const char *scan_limited_body(apr_pool_t *pool, replace_config *cfg,
+                                     const char *const *chunks)
+{
+    apr_bucket_alloc_t *alloc = apr_bucket_alloc_create(pool);
+    apr_bucket_brigade *bb = apr_brigade_create(pool, alloc);
+    conn_rec *c = apr_pcalloc(pool, sizeof(conn_rec));
+    ap_filter_t *f = apr_pcalloc(pool, sizeof(ap_filter_t));
+    replace_ctx *ctx = apr_pcalloc(pool, sizeof(replace_ctx));
+    apr_bucket *b, *next_b;
+    char *out;
+    apr_size_t len;
+
+    c->bucket_alloc = alloc;
+    f->c = c;
+    ctx->bb = apr_brigade_create(pool, alloc);
+    ctx->pool = pool;
+    ctx->cfg = cfg;
+    ctx->variables = apr_hash_make(pool);
+    for (; *chunks; chunks++) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(*chunks, strlen(*chunks), NULL, alloc));
+    }
+
+    for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = next_b) {
+        apr_size_t cut;
+        int reached;
+
+        assert(scan_limit_cut(ctx, b, &cut, &reached) == APR_SUCCESS);
+        next_b = APR_BUCKET_NEXT(b);
+        if (reached) {
+            if (cut < b->length) {
+                apr_bucket_split(b, cut);
+            }
+            APR_BUCKET_REMOVE(b);
+            APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
+            break;
+        }
+        ctx->scanned += (apr_off_t)b->length;
+        APR_BUCKET_REMOVE(b);
+        APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
+    }
+    // Limit reached, or the body ended within it
+    replace_collected(f, ctx, bb);
+
+    assert(apr_brigade_pflatten(bb, &out, &len, pool) == APR_SUCCESS);
+    return apr_pstrmemdup(pool, out, len);
+}
+
+void test_scan_limit_boundary(apr_pool_t *pconf)
+{
+    static const char *const rules[] = {
+        "cat", "dog",
+        NULL
+    };
+    static const replace_rule_options word = { AC_BOUNDARY_WORD, AC_BOUNDARY_WORD, 0 };
+    // Every body has "the cat" as its first 7 bytes, the scan limit
+    static const struct {
+        const char *chunks[4];
+        const char *expected;
+    } cases[] = {
+        { { "the cats sat", NULL }, "the cats sat" },
+        { { "the cat", "s sat", NULL }, "the cats sat" },
+        { { "the cat", "", "s sat", NULL }, "the cats sat" },
+        { { "the cat sat", NULL }, "the dog sat" },
+        { { "the cat", " sat", NULL }, "the dog sat" },
+        { { "the cat", NULL }, "the dog" },
+        { { "the ca", "t", NULL }, "the dog" },
+    };
+
+    printf("Test 3: Word boundary at ReplaceScanLimit...\n");
+
+    replace_config *cfg = make_config(pconf, rules, &word);
+    cfg->scan_limit = 7;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        apr_pool_t *pool;
+
+        assert(apr_pool_create(&pool, pconf) == APR_SUCCESS);
+        const char *result = scan_limited_body(pool, cfg, cases[i].chunks);
+        printf("  \"%s\" -> \"%s\"\n", cases[i].expected, result);
+        assert(strcmp(result, cases[i].expected) == 0);
+        apr_pool_destroy(pool);
+    }
+
+    // The terminator ends the prefix the same way
+    cfg->scan_limit = 0;
+    cfg->scan_terminator = "cat";
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        apr_pool_t *pool;
+
+        assert(apr_pool_create(&pool, pconf) == APR_SUCCESS);
+        const char *result = scan_limited_body(pool, cfg, cases[i].chunks);
+        assert(strcmp(result, cases[i].expected) == 0);
+        apr_pool_destroy(pool);
+    }
+    printf("  ✓ Passed\n\n");
+}
+
+int main(void)
+{
+    apr_pool_t *pconf;
+
+    printf("=== mod_replace Module Tests ===\n\n");
+
+    apr_initialize();
+    atexit(apr_terminate);
+    assert(apr_pool_create(&pconf, NULL) == APR_SUCCESS);
+
+    test_request_memory(pconf);
+    test_csp_nonce(pconf);
+    test_scan_limit_boundary(pconf);
+
+    apr_pool_destroy(pconf);
+    printf("=== All tests passed! ===\n");
+    return 0;
+}